@@ -31,6 +31,10 @@ const char *gstreamer_control_commands[NUM_CMDS] = {
 	"volume",
 	"loop",
 	"stop",
+	"normalize",
+	"crossfade",
+	"order",
+	"profile",
 };
 
 /* NULLs signal this functional isn't available */
@@ -46,6 +50,10 @@ const char *avrcp_control_commands[NUM_CMDS] = {
 	NULL,
 	NULL,
 	"Stop",
+	NULL,
+	NULL,
+	NULL,
+	NULL,
 };
 
 int get_command_index(const char *name)
@@ -93,5 +101,309 @@ void g_free_playlist_item(void *ptr)
 	g_free(item->artist);
 	g_free(item->genre);
 	g_free(item->media_path);
+	g_free(item->uri);
 	g_free(item);
 }
+
+/*
+ * Identify the current version of a local media file by its modification
+ * time and size, returns NULL for anything else than an existing local file.
+ */
+gchar *media_file_stamp(const char *uri)
+{
+	gchar *filename = g_filename_from_uri(uri, NULL, NULL);
+	struct stat st;
+	int ret;
+
+	if (!filename)
+		return NULL;
+
+	ret = stat(filename, &st);
+	g_free(filename);
+
+	if (ret < 0)
+		return NULL;
+
+	return g_strdup_printf("%ld:%lld", (long) st.st_mtime, (long long) st.st_size);
+}
+
+/* file of the media cache or log @name, in the user cache directory */
+gchar *media_cache_filename(const char *name)
+{
+	return g_build_filename(g_get_user_cache_dir(), "mediaplayer", name, NULL);
+}
+
+/*
+ * Media caches are key files with one group per media URI, each holding the
+ * stamp of the file the cached values were computed from.
+ */
+GKeyFile *media_cache_load(const char *name)
+{
+	GKeyFile *cache = g_key_file_new();
+	gchar *filename = media_cache_filename(name);
+
+	g_key_file_load_from_file(cache, filename, G_KEY_FILE_NONE, NULL);
+	g_free(filename);
+
+	return cache;
+}
+
+gboolean media_cache_save(GKeyFile *cache, const char *name)
+{
+	gchar *contents;
+	gsize length = 0;
+	gboolean ret;
+
+	contents = g_key_file_to_data(cache, &length, NULL);
+	ret = media_cache_write(name, contents, length);
+	g_free(contents);
+
+	return ret;
+}
+
+/*
+ * Write @contents of a cache dumped with g_key_file_to_data() as the cache
+ * @name, which needs no access to the cache itself.
+ */
+gboolean media_cache_write(const char *name, const gchar *contents,
+			   gsize length)
+{
+	gchar *filename = media_cache_filename(name);
+	gchar *dirname = g_path_get_dirname(filename);
+	gboolean ret;
+
+	g_mkdir_with_parents(dirname, 0700);
+	ret = g_file_set_contents(filename, contents, length, NULL);
+
+	g_free(dirname);
+	g_free(filename);
+
+	return ret;
+}
+
+/*
+ * TRUE if @cache holds values for the version of @uri identified by @stamp,
+ * see media_file_stamp(). Values of other versions are dropped.
+ */
+gboolean media_cache_match(GKeyFile *cache, const char *uri, const char *stamp)
+{
+	gchar *cached;
+	gboolean ret;
+
+	cached = g_key_file_get_string(cache, uri, "stamp", NULL);
+	if (!cached)
+		return FALSE;
+
+	ret = !g_strcmp0(stamp, cached);
+
+	if (!ret)
+		g_key_file_remove_group(cache, uri, NULL);
+
+	g_free(cached);
+
+	return ret;
+}
+
+/* TRUE if @cache holds values for the current version of @uri */
+gboolean media_cache_lookup(GKeyFile *cache, const char *uri)
+{
+	gchar *stamp = media_file_stamp(uri);
+	gboolean ret = media_cache_match(cache, uri, stamp);
+
+	g_free(stamp);
+
+	return ret;
+}
+
+/* record the version @stamp of @uri, dropping values of other ones */
+void media_cache_set_stamp(GKeyFile *cache, const char *uri, const char *stamp)
+{
+	gchar *cached = g_key_file_get_string(cache, uri, "stamp", NULL);
+
+	if (g_strcmp0(stamp, cached))
+		g_key_file_remove_group(cache, uri, NULL);
+
+	if (stamp)
+		g_key_file_set_string(cache, uri, "stamp", stamp);
+
+	g_free(cached);
+}
+
+/* record the current version of @uri, dropping values of previous ones */
+void media_cache_stamp(GKeyFile *cache, const char *uri)
+{
+	gchar *stamp = media_file_stamp(uri);
+
+	media_cache_set_stamp(cache, uri, stamp);
+	g_free(stamp);
+}
+
+void media_chapter_free(void *ptr)
+{
+	struct media_chapter *chapter = ptr;
+
+	g_free(chapter->title);
+	g_free(chapter->artist);
+	g_free(chapter->album);
+	g_free(chapter);
+}
+
+/* CUE sheet next to @filename: album.cue or album.flac.cue */
+static gchar *cue_sheet_find(const char *filename)
+{
+	const char *dot = strrchr(filename, '.');
+	gchar *cue;
+
+	if (dot && !strchr(dot, '/')) {
+		gchar *base = g_strndup(filename, dot - filename);
+
+		cue = g_strconcat(base, ".cue", NULL);
+		g_free(base);
+
+		if (g_file_test(cue, G_FILE_TEST_IS_REGULAR))
+			return cue;
+		g_free(cue);
+	}
+
+	cue = g_strconcat(filename, ".cue", NULL);
+	if (g_file_test(cue, G_FILE_TEST_IS_REGULAR))
+		return cue;
+	g_free(cue);
+
+	return NULL;
+}
+
+/* argument of a CUE command, unquoted, the rest of the line if @rest */
+static gchar *cue_sheet_arg(const char *line, gboolean rest)
+{
+	const char *end;
+
+	while (*line == ' ' || *line == '\t')
+		line++;
+
+	if (*line == '"') {
+		end = strchr(++line, '"');
+		return g_strndup(line, end ? end - line : strlen(line));
+	}
+
+	end = rest ? line + strlen(line) : strpbrk(line, " \t");
+
+	return g_strndup(line, end ? end - line : strlen(line));
+}
+
+/*
+ * Parses the CUE sheet describing the local file @uri, if any. Only the
+ * tracks of @uri are kept when the sheet lists several files. Returns the
+ * chapters in playback order, or NULL without at least two of them.
+ */
+GPtrArray *media_chapters_from_cue(const char *uri)
+{
+	gchar *filename = g_filename_from_uri(uri, NULL, NULL);
+	gchar *cue, *contents = NULL, *basename, *album = NULL, *performer = NULL;
+	struct media_chapter *chapter = NULL;
+	GPtrArray *chapters;
+	gboolean matching = TRUE, first_matching = FALSE;
+	gchar **lines;
+	int i, files = 0;
+
+	if (!filename)
+		return NULL;
+
+	cue = cue_sheet_find(filename);
+	if (!cue || !g_file_get_contents(cue, &contents, NULL, NULL)) {
+		g_free(cue);
+		g_free(filename);
+		return NULL;
+	}
+
+	// CUE sheets are often written in a legacy encoding
+	if (!g_utf8_validate(contents, -1, NULL)) {
+		gchar *utf8 = g_convert(contents, -1, "UTF-8", "WINDOWS-1252",
+					NULL, NULL, NULL);
+
+		g_free(contents);
+		contents = utf8 ? utf8 : g_strdup("");
+	}
+
+	basename = g_path_get_basename(filename);
+	chapters = g_ptr_array_new_with_free_func(media_chapter_free);
+	lines = g_strsplit(contents, "\n", -1);
+
+	for (i = 0; lines[i]; i++) {
+		gchar *line = g_strstrip(lines[i]);
+
+		if (g_str_has_prefix(line, "FILE ")) {
+			gchar *file = cue_sheet_arg(line + 5, FALSE);
+			gchar *name = g_path_get_basename(file);
+
+			// a sheet for a single file still matches a renamed file,
+			// tracks of another file are dropped once a second shows up
+			if (files == 1 && !first_matching)
+				g_ptr_array_set_size(chapters, 0);
+
+			matching = !g_ascii_strcasecmp(name, basename);
+			if (!files++)
+				first_matching = matching;
+			matching |= files == 1;
+
+			g_free(name);
+			g_free(file);
+			chapter = NULL;
+		} else if (g_str_has_prefix(line, "TRACK ")) {
+			chapter = NULL;
+			if (!matching || !strstr(line, "AUDIO"))
+				continue;
+
+			chapter = g_new0(struct media_chapter, 1);
+			chapter->start = -1;
+			chapter->album = g_strdup(album);
+			chapter->artist = g_strdup(performer);
+			g_ptr_array_add(chapters, chapter);
+		} else if (g_str_has_prefix(line, "TITLE ")) {
+			gchar **field = chapter ? &chapter->title : &album;
+
+			g_free(*field);
+			*field = cue_sheet_arg(line + 6, TRUE);
+		} else if (g_str_has_prefix(line, "PERFORMER ")) {
+			gchar **field = chapter ? &chapter->artist : &performer;
+
+			g_free(*field);
+			*field = cue_sheet_arg(line + 10, TRUE);
+		} else if (g_str_has_prefix(line, "INDEX 01 ") && chapter) {
+			unsigned int min, sec, frames;
+
+			// mm:ss:ff with 75 frames per second
+			if (sscanf(line + 9, "%u:%u:%u", &min, &sec, &frames) == 3)
+				chapter->start = (min * 60 + sec) * 1000 +
+						 frames * 1000 / 75;
+		}
+	}
+
+	// drop tracks without a start, each one ends where the next starts
+	for (i = chapters->len - 1; i >= 0; i--) {
+		if (((struct media_chapter *) chapters->pdata[i])->start < 0)
+			g_ptr_array_remove_index(chapters, i);
+	}
+
+	for (i = 0; i + 1 < chapters->len; i++) {
+		struct media_chapter *current = chapters->pdata[i];
+		struct media_chapter *next = chapters->pdata[i + 1];
+
+		current->end = next->start;
+	}
+
+	if (chapters->len < 2) {
+		g_ptr_array_free(chapters, TRUE);
+		chapters = NULL;
+	}
+
+	g_strfreev(lines);
+	g_free(basename);
+	g_free(performer);
+	g_free(album);
+	g_free(contents);
+	g_free(cue);
+	g_free(filename);
+
+	return chapters;
+}
@@ -24,6 +24,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <glib.h>
 #include <json-c/json.h>
 
@@ -36,6 +37,13 @@ struct playlist_item {
     gint64 duration;
     gchar *media_path;
     gchar *media_type;
+
+    /* chapter of a single file album or audiobook, see media_chapter */
+    gchar *uri;             /* file holding the chapter, NULL for whole media */
+    gint64 start;           /* milliseconds */
+    gint64 end;             /* milliseconds, 0 up to the end of the file */
+
+    guint revision;         /* changes whenever the item does */
 };
 
 enum {
@@ -50,6 +58,10 @@ enum {
     VOLUME_CMD,
     LOOP_CMD,
     STOP_CMD,
+    NORMALIZE_CMD,
+    CROSSFADE_CMD,
+    ORDER_CMD,
+    PROFILE_CMD,
     NUM_CMDS
 };
 
@@ -59,4 +71,27 @@ int get_command_index(const char *name);
 GList *find_media_index(GList *list, long int index);
 void g_free_playlist_item(void *ptr);
 
+gchar *media_file_stamp(const char *uri);
+gchar *media_cache_filename(const char *name);
+GKeyFile *media_cache_load(const char *name);
+gboolean media_cache_save(GKeyFile *cache, const char *name);
+gboolean media_cache_write(const char *name, const gchar *contents,
+                           gsize length);
+gboolean media_cache_match(GKeyFile *cache, const char *uri, const char *stamp);
+gboolean media_cache_lookup(GKeyFile *cache, const char *uri);
+void media_cache_set_stamp(GKeyFile *cache, const char *uri, const char *stamp);
+void media_cache_stamp(GKeyFile *cache, const char *uri);
+
+/* chapter from a CUE sheet or container tags, times in milliseconds */
+struct media_chapter {
+    gchar *title;
+    gchar *artist;
+    gchar *album;
+    gint64 start;
+    gint64 end;             /* 0 up to the end of the file */
+};
+
+void media_chapter_free(void *ptr);
+GPtrArray *media_chapters_from_cue(const char *uri);
+
 #endif /* _AFM_COMMON_H */
@@ -0,0 +1,349 @@
+/*
+ * Copyright (C) 2017 Konsulko Group
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include "afm-history.h"
+
+/*
+ * Play history kept as an append-only log in the user cache directory, one
+ * line per record:
+ *
+ *  - "p <time> <path>" when a track was played,
+ *  - "s <time> <path>" when it was skipped,
+ *  - "a <time> <plays> <skips> <path>" aggregating the earlier records of a
+ *    path, <time> being the last play,
+ *
+ * with times in seconds since the epoch. The log is replayed once when
+ * loaded into per path aggregates, and rewritten as aggregate records when
+ * it holds many more records than paths. Views are answered from sequences
+ * of the aggregates kept sorted as records are added, never from the log.
+ *
+ * Records are added in memory and appended to the log in batches, see
+ * history_take() and history_write(). It is not thread safe, callers are
+ * expected to serialize the accesses but history_write().
+ */
+
+#define HISTORY_COMPACT_MIN	1024	/* records below which no compaction */
+#define HISTORY_COMPACT_RATIO	4	/* records per path to compact above */
+
+struct history_record {
+	struct history_entry entry;
+	GSequenceIter *recent;	/* NULL until played */
+	GSequenceIter *played;	/* NULL until played */
+};
+
+struct history {
+	gchar *filename;
+	GHashTable *records;	/* path -> struct history_record */
+	GSequence *views[HISTORY_NUM_VIEWS];
+	GString *pending;	/* records not written yet */
+	guint num_pending;
+};
+
+const char *history_views[HISTORY_NUM_VIEWS] = {
+	"recent",
+	"most-played",
+};
+
+static gint record_compare_recent(gconstpointer a, gconstpointer b,
+				  gpointer user_data)
+{
+	const struct history_entry *ea = a, *eb = b;
+
+	if (ea->last_played != eb->last_played)
+		return ea->last_played > eb->last_played ? -1 : 1;
+
+	return strcmp(ea->path, eb->path);
+}
+
+static gint record_compare_played(gconstpointer a, gconstpointer b,
+				  gpointer user_data)
+{
+	const struct history_entry *ea = a, *eb = b;
+
+	if (ea->plays != eb->plays)
+		return ea->plays > eb->plays ? -1 : 1;
+
+	return record_compare_recent(a, b, user_data);
+}
+
+static struct history_record *history_record_get(struct history *history,
+						 const char *path)
+{
+	struct history_record *record = g_hash_table_lookup(history->records, path);
+	gchar *key;
+
+	if (record)
+		return record;
+
+	key = g_strdup(path);
+	record = g_new0(struct history_record, 1);
+	record->entry.path = key;
+	g_hash_table_insert(history->records, key, record);
+
+	return record;
+}
+
+/* apply @plays, @skips and a last play at @time to the aggregates of @path */
+static void history_count(struct history *history, const char *path,
+			  guint plays, guint skips, gint64 time)
+{
+	struct history_record *record = history_record_get(history, path);
+
+	record->entry.skips += skips;
+	if (!plays)
+		return;
+
+	if (record->recent) {
+		g_sequence_remove(record->recent);
+		g_sequence_remove(record->played);
+	}
+
+	record->entry.plays += plays;
+	record->entry.last_played = MAX(record->entry.last_played, time);
+
+	record->recent = g_sequence_insert_sorted(history->views[HISTORY_RECENT],
+						  &record->entry,
+						  record_compare_recent, NULL);
+	record->played = g_sequence_insert_sorted(history->views[HISTORY_MOST_PLAYED],
+						  &record->entry,
+						  record_compare_played, NULL);
+}
+
+/* apply a record of the log, FALSE if it is malformed */
+static gboolean history_replay(struct history *history, const char *line)
+{
+	gchar *end = NULL;
+	gint64 time, plays = 0, skips = 0;
+	char kind = line[0];
+
+	if ((kind != 'p' && kind != 's' && kind != 'a') || line[1] != ' ')
+		return FALSE;
+
+	time = g_ascii_strtoll(line + 2, &end, 10);
+	if (end == line + 2 || *end != ' ')
+		return FALSE;
+
+	if (kind == 'a') {
+		gchar *start = end + 1;
+
+		plays = g_ascii_strtoll(start, &end, 10);
+		if (end == start || *end != ' ')
+			return FALSE;
+
+		start = end + 1;
+		skips = g_ascii_strtoll(start, &end, 10);
+		if (end == start || *end != ' ')
+			return FALSE;
+	} else if (kind == 'p') {
+		plays = 1;
+	} else {
+		skips = 1;
+	}
+
+	if (!end[1] || plays < 0 || skips < 0)
+		return FALSE;
+
+	history_count(history, end + 1, plays, skips, time);
+
+	return TRUE;
+}
+
+/* rewrite the log as one aggregate record per path */
+static gboolean history_compact(struct history *history)
+{
+	GString *log = g_string_new(NULL);
+	GHashTableIter iter;
+	gpointer value;
+	gboolean ret;
+
+	g_hash_table_iter_init(&iter, history->records);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct history_entry *entry = value;
+
+		g_string_append_printf(log, "a %" G_GINT64_FORMAT " %u %u %s\n",
+				       entry->last_played, entry->plays,
+				       entry->skips, entry->path);
+	}
+
+	ret = g_file_set_contents(history->filename, log->str, log->len, NULL);
+	g_string_free(log, TRUE);
+
+	return ret;
+}
+
+/*
+ * Load the history logged in the cache file @name, compacting the log when
+ * it grew too large or ends with a record cut short.
+ */
+struct history *history_load(const char *name)
+{
+	struct history *history = g_new0(struct history, 1);
+	gchar *contents = NULL, *line, *next;
+	gsize length = 0;
+	guint records = 0;
+	gboolean truncated;
+	int view;
+
+	history->filename = media_cache_filename(name);
+	history->records = g_hash_table_new_full(g_str_hash, g_str_equal,
+						 g_free, g_free);
+	for (view = 0; view < HISTORY_NUM_VIEWS; view++)
+		history->views[view] = g_sequence_new(NULL);
+	history->pending = g_string_new(NULL);
+
+	if (!g_file_get_contents(history->filename, &contents, &length, NULL))
+		return history;
+
+	// a record cut short by a crash is dropped, not replayed
+	truncated = length && contents[length - 1] != '\n';
+	if (truncated) {
+		line = strrchr(contents, '\n');
+		if (line)
+			line[1] = '\0';
+		else
+			contents[0] = '\0';
+	}
+
+	for (line = contents; line && *line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+
+		if (history_replay(history, line))
+			records++;
+	}
+
+	// left as it is on failure, at worst losing the next record too
+	if (truncated ||
+	    (records > HISTORY_COMPACT_MIN &&
+	     records > HISTORY_COMPACT_RATIO * g_hash_table_size(history->records)))
+		history_compact(history);
+
+	g_free(contents);
+
+	return history;
+}
+
+void history_free(struct history *history)
+{
+	int view;
+
+	if (!history)
+		return;
+
+	for (view = 0; view < HISTORY_NUM_VIEWS; view++)
+		g_sequence_free(history->views[view]);
+
+	g_hash_table_destroy(history->records);
+	g_string_free(history->pending, TRUE);
+	g_free(history->filename);
+	g_free(history);
+}
+
+/* count a play of @path, or a skip if @skipped, at unix @time */
+void history_add(struct history *history, const char *path, gboolean skipped,
+		 gint64 time)
+{
+	// the path ends the record, which ends the line
+	if (!path || !*path || strchr(path, '\n'))
+		return;
+
+	history_count(history, path, !skipped, !!skipped, time);
+
+	g_string_append_printf(history->pending, "%c %" G_GINT64_FORMAT " %s\n",
+			       skipped ? 's' : 'p', time, path);
+	history->num_pending++;
+}
+
+/* number of records added since the last history_take() */
+guint history_pending(struct history *history)
+{
+	return history->num_pending;
+}
+
+/* Returns the records added since the last call, or NULL if there are none */
+GString *history_take(struct history *history)
+{
+	GString *records = history->pending;
+
+	if (!history->num_pending)
+		return NULL;
+
+	history->pending = g_string_new(NULL);
+	history->num_pending = 0;
+
+	return records;
+}
+
+/*
+ * Append @records, taken with history_take(), to the log and sync it to
+ * disk. Frees @records. As it does not access the aggregates it may run
+ * concurrently with the other calls, but not with itself.
+ */
+gboolean history_write(struct history *history, GString *records)
+{
+	gchar *dirname = g_path_get_dirname(history->filename);
+	gsize done = 0;
+	gboolean ret = FALSE;
+	int fd;
+
+	g_mkdir_with_parents(dirname, 0700);
+	g_free(dirname);
+
+	fd = open(history->filename, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+	if (fd >= 0) {
+		while (done < records->len) {
+			ssize_t len = write(fd, records->str + done, records->len - done);
+
+			if (len < 0 && errno == EINTR)
+				continue;
+			if (len <= 0)
+				break;
+			done += len;
+		}
+
+		ret = done == records->len && fdatasync(fd) == 0;
+		close(fd);
+	}
+
+	g_string_free(records, TRUE);
+
+	return ret;
+}
+
+/*
+ * Returns the entries of @view restricted to the page described by @offset
+ * and @limit, only paths played at least once being listed. @total is set to
+ * the number of entries across all pages. Entries are owned by the history
+ * and valid until the next history_add().
+ */
+GPtrArray *history_view(struct history *history, int view, int offset,
+			int limit, int *total)
+{
+	GSequence *seq = history->views[view];
+	GSequenceIter *iter;
+	GPtrArray *results = g_ptr_array_new();
+
+	*total = g_sequence_get_length(seq);
+
+	for (iter = g_sequence_get_iter_at_pos(seq, MAX(offset, 0));
+	     !g_sequence_iter_is_end(iter) && (limit < 0 || results->len < (guint) limit);
+	     iter = g_sequence_iter_next(iter))
+		g_ptr_array_add(results, g_sequence_get(iter));
+
+	return results;
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2017 Konsulko Group
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _AFM_HISTORY_H
+#define _AFM_HISTORY_H
+
+#include "afm-common.h"
+
+enum {
+    HISTORY_RECENT = 0,
+    HISTORY_MOST_PLAYED,
+    HISTORY_NUM_VIEWS
+};
+
+/* play counts of a media path, see history_view() */
+struct history_entry {
+    const char *path;       /* owned by the history */
+    guint plays;
+    guint skips;
+    gint64 last_played;     /* unix time in seconds, 0 if never played */
+};
+
+struct history;
+
+extern const char *history_views[HISTORY_NUM_VIEWS];
+
+struct history *history_load(const char *name);
+void history_free(struct history *history);
+void history_add(struct history *history, const char *path, gboolean skipped,
+                 gint64 time);
+guint history_pending(struct history *history);
+GString *history_take(struct history *history);
+gboolean history_write(struct history *history, GString *records);
+GPtrArray *history_view(struct history *history, int view, int offset,
+                        int limit, int *total);
+
+#endif /* _AFM_HISTORY_H */
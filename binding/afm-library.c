@@ -0,0 +1,766 @@
+/*
+ * Copyright (C) 2017 Konsulko Group
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "afm-library.h"
+
+/*
+ * Secondary indexes over the playlist items, kept up to date as items are
+ * added, updated and removed so that searches never walk the whole library:
+ *
+ *  - one sequence per field sorted by its case folded value, which answers
+ *    prefix and exact lookups with a binary search,
+ *  - a trigram index of the title, artist and album, whose smallest posting
+ *    list bounds the candidates of a substring search,
+ *  - a tree of artists, their albums and the tracks of those albums, whose
+ *    nodes keep the number and total duration of the tracks below them,
+ *  - one sequence per sort order holding every entry, walked in place to
+ *    list or play the items in that order.
+ *
+ * Items are not owned by the library. It is not thread safe, callers are
+ * expected to serialize the accesses.
+ */
+
+#define TRIGRAM_LEN	3
+
+/* node of the browse tree: the root, an artist or an album */
+struct library_group {
+	gchar *key;
+	gchar *name;
+	int tracks;
+	gint64 duration;
+	GSequence *children;	/* groups sorted by key, or entries of an album */
+	GHashTable *lookup;	/* key -> child group, NULL for an album */
+	struct library_group *parent;
+	GSequenceIter *iter;
+};
+
+struct library_entry {
+	struct playlist_item *item;
+	gchar *keys[LIBRARY_NUM_FIELDS];
+	GSequenceIter *sorted[LIBRARY_NUM_FIELDS];
+	struct library_group *album;
+	GSequenceIter *browse;
+	GSequenceIter *ordered[LIBRARY_NUM_ORDERS];
+	gint64 duration;
+};
+
+struct library {
+	GHashTable *entries;
+	GSequence *sorted[LIBRARY_NUM_FIELDS];
+	GHashTable *trigrams;
+	struct library_group *root;
+	GSequence *orders[LIBRARY_NUM_ORDERS];	/* NULL for the playlist order */
+};
+
+const char *library_fields[LIBRARY_NUM_FIELDS] = {
+	"title",
+	"artist",
+	"album",
+	"genre",
+};
+
+const char *library_matches[LIBRARY_NUM_MATCHES] = {
+	"substring",
+	"prefix",
+};
+
+const char *library_orders[LIBRARY_NUM_ORDERS] = {
+	"index",
+	"title",
+	"artist",
+	"path",
+	"duration",
+	"added",
+};
+
+static gchar *library_fold(const char *str)
+{
+	gchar *normalized, *folded;
+
+	if (!str)
+		return NULL;
+
+	normalized = g_utf8_normalize(str, -1, G_NORMALIZE_ALL);
+	if (!normalized)
+		return NULL;
+
+	folded = g_utf8_casefold(normalized, -1);
+	g_free(normalized);
+
+	return folded;
+}
+
+static const char *entry_field(const struct library_entry *entry, int field)
+{
+	switch (field) {
+	case LIBRARY_TITLE:
+		return entry->item->title;
+	case LIBRARY_ARTIST:
+		return entry->item->artist;
+	case LIBRARY_ALBUM:
+		return entry->item->album;
+	case LIBRARY_GENRE:
+		return entry->item->genre;
+	}
+
+	return NULL;
+}
+
+/* order by key then playlist index, a NULL item sorts first among equal keys */
+static gint entry_compare(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+	const struct library_entry *ea = a, *eb = b;
+	int field = GPOINTER_TO_INT(user_data);
+	int ret = strcmp(ea->keys[field], eb->keys[field]);
+
+	if (ret)
+		return ret;
+
+	if (!ea->item || !eb->item)
+		return !eb->item - !ea->item;
+
+	return ea->item->id - eb->item->id;
+}
+
+static gint entry_compare_id(gconstpointer a, gconstpointer b)
+{
+	const struct library_entry *ea = *(struct library_entry **) a;
+	const struct library_entry *eb = *(struct library_entry **) b;
+
+	return ea->item->id - eb->item->id;
+}
+
+static gint entry_compare_item(gconstpointer a, gconstpointer b,
+			       gpointer user_data)
+{
+	const struct library_entry *ea = a, *eb = b;
+
+	return ea->item->id - eb->item->id;
+}
+
+/* compare optional keys, entries missing one sort last */
+static int key_compare(const char *a, const char *b)
+{
+	if (!a || !b)
+		return !a - !b;
+
+	return strcmp(a, b);
+}
+
+static gint entry_compare_order(gconstpointer a, gconstpointer b,
+				gpointer user_data)
+{
+	const struct library_entry *ea = a, *eb = b;
+	int ret = 0;
+
+	switch (GPOINTER_TO_INT(user_data)) {
+	case LIBRARY_ORDER_TITLE:
+		ret = key_compare(ea->keys[LIBRARY_TITLE], eb->keys[LIBRARY_TITLE]);
+		break;
+	case LIBRARY_ORDER_ARTIST:
+		ret = key_compare(ea->keys[LIBRARY_ARTIST], eb->keys[LIBRARY_ARTIST]);
+		if (!ret)
+			ret = key_compare(ea->keys[LIBRARY_ALBUM],
+					  eb->keys[LIBRARY_ALBUM]);
+		break;
+	case LIBRARY_ORDER_PATH:
+		ret = strcmp(ea->item->media_path, eb->item->media_path);
+		break;
+	case LIBRARY_ORDER_DURATION:
+		ret = (ea->duration > eb->duration) - (ea->duration < eb->duration);
+		break;
+	case LIBRARY_ORDER_ADDED:
+		return eb->item->id - ea->item->id;
+	}
+
+	return ret ? ret : ea->item->id - eb->item->id;
+}
+
+static gint group_compare(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+	const struct library_group *ga = a, *gb = b;
+
+	return strcmp(ga->key, gb->key);
+}
+
+static struct library_group *group_new(const char *key, const char *name,
+				       gboolean album)
+{
+	struct library_group *group = g_new0(struct library_group, 1);
+
+	group->key = g_strdup(key);
+	group->name = g_strdup(name);
+	group->children = g_sequence_new(NULL);
+
+	if (!album)
+		group->lookup = g_hash_table_new(g_str_hash, g_str_equal);
+
+	return group;
+}
+
+static void group_free(struct library_group *group)
+{
+	if (group->lookup)
+		g_hash_table_destroy(group->lookup);
+
+	g_sequence_free(group->children);
+	g_free(group->name);
+	g_free(group->key);
+	g_free(group);
+}
+
+/* the child group of @parent for @key, created on first use */
+static struct library_group *group_get(struct library_group *parent,
+				       const char *key, const char *name,
+				       gboolean album)
+{
+	struct library_group *group = g_hash_table_lookup(parent->lookup, key);
+
+	if (group)
+		return group;
+
+	group = group_new(key, name, album);
+	group->parent = parent;
+	group->iter = g_sequence_insert_sorted(parent->children, group,
+					       group_compare, NULL);
+	g_hash_table_insert(parent->lookup, group->key, group);
+
+	return group;
+}
+
+static void browse_index(struct library *library, struct library_entry *entry)
+{
+	struct playlist_item *item = entry->item;
+	struct library_group *artist, *group;
+
+	artist = group_get(library->root,
+			   entry->keys[LIBRARY_ARTIST] ?: "",
+			   item->artist ?: "", FALSE);
+	entry->album = group_get(artist,
+				 entry->keys[LIBRARY_ALBUM] ?: "",
+				 item->album ?: "", TRUE);
+	entry->browse = g_sequence_insert_sorted(entry->album->children, entry,
+						 entry_compare_item, NULL);
+
+	for (group = entry->album; group; group = group->parent) {
+		group->tracks++;
+		group->duration += entry->duration;
+	}
+}
+
+static void browse_unindex(struct library *library, struct library_entry *entry)
+{
+	struct library_group *group;
+
+	g_sequence_remove(entry->browse);
+	entry->browse = NULL;
+
+	for (group = entry->album; group; group = group->parent) {
+		group->tracks--;
+		group->duration -= entry->duration;
+	}
+
+	// drop the album and artist left without tracks
+	group = entry->album;
+	while (group->parent && !group->tracks) {
+		struct library_group *parent = group->parent;
+
+		g_hash_table_remove(parent->lookup, group->key);
+		g_sequence_remove(group->iter);
+		group_free(group);
+		group = parent;
+	}
+
+	entry->album = NULL;
+}
+
+static guint32 trigram_key(const char *str)
+{
+	return (guint8) str[0] | (guint8) str[1] << 8 | (guint8) str[2] << 16;
+}
+
+/* collect the distinct trigrams of the text fields of @entry in @set */
+static void entry_trigrams(struct library_entry *entry, GHashTable *set)
+{
+	int field;
+
+	for (field = 0; field < LIBRARY_NUM_FIELDS; field++) {
+		const char *key = entry->keys[field];
+		size_t i, len;
+
+		if (!key || !(LIBRARY_TEXT_FIELDS & (1 << field)))
+			continue;
+
+		len = strlen(key);
+		for (i = 0; i + TRIGRAM_LEN <= len; i++)
+			g_hash_table_add(set, GUINT_TO_POINTER(trigram_key(key + i)));
+	}
+}
+
+static void library_index(struct library *library, struct library_entry *entry)
+{
+	GHashTable *set = g_hash_table_new(g_direct_hash, g_direct_equal);
+	GHashTableIter iter;
+	gpointer trigram;
+	int field, order;
+
+	for (field = 0; field < LIBRARY_NUM_FIELDS; field++) {
+		entry->keys[field] = library_fold(entry_field(entry, field));
+		if (!entry->keys[field])
+			continue;
+
+		entry->sorted[field] = g_sequence_insert_sorted(
+				library->sorted[field], entry, entry_compare,
+				GINT_TO_POINTER(field));
+	}
+
+	entry->duration = MAX(entry->item->duration, 0);
+
+	for (order = 0; order < LIBRARY_NUM_ORDERS; order++) {
+		if (library->orders[order])
+			entry->ordered[order] = g_sequence_insert_sorted(
+					library->orders[order], entry,
+					entry_compare_order, GINT_TO_POINTER(order));
+	}
+
+	browse_index(library, entry);
+	entry_trigrams(entry, set);
+
+	g_hash_table_iter_init(&iter, set);
+	while (g_hash_table_iter_next(&iter, &trigram, NULL)) {
+		GPtrArray *posting = g_hash_table_lookup(library->trigrams, trigram);
+
+		if (!posting) {
+			posting = g_ptr_array_new();
+			g_hash_table_insert(library->trigrams, trigram, posting);
+		}
+
+		g_ptr_array_add(posting, entry);
+	}
+
+	g_hash_table_destroy(set);
+}
+
+static void library_unindex(struct library *library, struct library_entry *entry)
+{
+	GHashTable *set = g_hash_table_new(g_direct_hash, g_direct_equal);
+	GHashTableIter iter;
+	gpointer trigram;
+	int field, order;
+
+	entry_trigrams(entry, set);
+
+	g_hash_table_iter_init(&iter, set);
+	while (g_hash_table_iter_next(&iter, &trigram, NULL)) {
+		GPtrArray *posting = g_hash_table_lookup(library->trigrams, trigram);
+
+		if (!posting)
+			continue;
+
+		g_ptr_array_remove_fast(posting, entry);
+		if (!posting->len)
+			g_hash_table_remove(library->trigrams, trigram);
+	}
+
+	g_hash_table_destroy(set);
+
+	browse_unindex(library, entry);
+
+	for (order = 0; order < LIBRARY_NUM_ORDERS; order++) {
+		if (entry->ordered[order])
+			g_sequence_remove(entry->ordered[order]);
+		entry->ordered[order] = NULL;
+	}
+
+	for (field = 0; field < LIBRARY_NUM_FIELDS; field++) {
+		if (entry->sorted[field])
+			g_sequence_remove(entry->sorted[field]);
+		entry->sorted[field] = NULL;
+
+		g_free(entry->keys[field]);
+		entry->keys[field] = NULL;
+	}
+}
+
+struct library *library_new(void)
+{
+	struct library *library = g_new0(struct library, 1);
+	int field, order;
+
+	library->entries = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+						 NULL, g_free);
+	library->trigrams = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+						  NULL, (GDestroyNotify) g_ptr_array_unref);
+
+	for (field = 0; field < LIBRARY_NUM_FIELDS; field++)
+		library->sorted[field] = g_sequence_new(NULL);
+
+	library->root = group_new("", "", FALSE);
+
+	for (order = LIBRARY_ORDER_INDEX + 1; order < LIBRARY_NUM_ORDERS; order++)
+		library->orders[order] = g_sequence_new(NULL);
+
+	return library;
+}
+
+void library_free(struct library *library)
+{
+	int field, order;
+
+	if (!library)
+		return;
+
+	library_clear(library);
+
+	for (field = 0; field < LIBRARY_NUM_FIELDS; field++)
+		g_sequence_free(library->sorted[field]);
+
+	for (order = 0; order < LIBRARY_NUM_ORDERS; order++) {
+		if (library->orders[order])
+			g_sequence_free(library->orders[order]);
+	}
+
+	group_free(library->root);
+	g_hash_table_destroy(library->trigrams);
+	g_hash_table_destroy(library->entries);
+	g_free(library);
+}
+
+void library_add(struct library *library, struct playlist_item *item)
+{
+	struct library_entry *entry;
+
+	if (g_hash_table_contains(library->entries, item))
+		return;
+
+	entry = g_new0(struct library_entry, 1);
+	entry->item = item;
+	library_index(library, entry);
+
+	g_hash_table_insert(library->entries, item, entry);
+}
+
+/* reindex @item after its fields changed, items not in @library are ignored */
+void library_update(struct library *library, struct playlist_item *item)
+{
+	struct library_entry *entry = g_hash_table_lookup(library->entries, item);
+
+	if (!entry)
+		return;
+
+	library_unindex(library, entry);
+	library_index(library, entry);
+}
+
+void library_remove(struct library *library, struct playlist_item *item)
+{
+	struct library_entry *entry = g_hash_table_lookup(library->entries, item);
+
+	if (!entry)
+		return;
+
+	library_unindex(library, entry);
+	g_hash_table_remove(library->entries, item);
+}
+
+void library_clear(struct library *library)
+{
+	GHashTableIter iter;
+	gpointer entry;
+
+	g_hash_table_iter_init(&iter, library->entries);
+	while (g_hash_table_iter_next(&iter, NULL, &entry))
+		library_unindex(library, entry);
+
+	g_hash_table_remove_all(library->entries);
+}
+
+/* append the entries whose @field starts with @key, or equals it if @exact */
+static void library_collect_sorted(struct library *library, int field,
+				   const char *key, gboolean exact,
+				   GPtrArray *matches)
+{
+	struct library_entry probe = { 0 };
+	GSequenceIter *iter;
+
+	probe.keys[field] = (gchar *) key;
+
+	iter = g_sequence_search(library->sorted[field], &probe, entry_compare,
+				 GINT_TO_POINTER(field));
+
+	for (; !g_sequence_iter_is_end(iter); iter = g_sequence_iter_next(iter)) {
+		struct library_entry *entry = g_sequence_get(iter);
+
+		if (exact ? strcmp(entry->keys[field], key) :
+			    !g_str_has_prefix(entry->keys[field], key))
+			break;
+
+		g_ptr_array_add(matches, entry);
+	}
+}
+
+/* the shortest posting list among the trigrams of @key, NULL if one is missing */
+static GPtrArray *library_posting(struct library *library, const char *key)
+{
+	GPtrArray *shortest = NULL;
+	size_t i, len = strlen(key);
+
+	for (i = 0; i + TRIGRAM_LEN <= len; i++) {
+		GPtrArray *posting = g_hash_table_lookup(library->trigrams,
+				GUINT_TO_POINTER(trigram_key(key + i)));
+
+		if (!posting)
+			return NULL;
+
+		if (!shortest || posting->len < shortest->len)
+			shortest = posting;
+	}
+
+	return shortest;
+}
+
+static gboolean entry_matches(const struct library_entry *entry,
+			      const struct library_query *query,
+			      const char *text, const char *genre)
+{
+	int field;
+
+	if (genre && g_strcmp0(entry->keys[LIBRARY_GENRE], genre))
+		return FALSE;
+
+	if (!text)
+		return TRUE;
+
+	for (field = 0; field < LIBRARY_NUM_FIELDS; field++) {
+		const char *key = entry->keys[field];
+
+		if (!key || !(query->fields & (1 << field)))
+			continue;
+
+		if (query->match == LIBRARY_MATCH_PREFIX ?
+		    g_str_has_prefix(key, text) : !!strstr(key, text))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Returns the items matching @query in playlist order, restricted to the page
+ * described by its offset and limit. @total is set to the number of matches
+ * across all pages.
+ */
+GPtrArray *library_search(struct library *library,
+			  const struct library_query *query, int *total)
+{
+	gchar *text = NULL, *genre = library_fold(query->genre);
+	guint fields = query->fields & LIBRARY_TEXT_FIELDS;
+	GPtrArray *matches = g_ptr_array_new();
+	GPtrArray *results;
+	guint i, kept = 0;
+	int field;
+
+	if (query->text && *query->text && fields)
+		text = library_fold(query->text);
+
+	// gather candidates from the most selective index available
+	if (text && query->match == LIBRARY_MATCH_PREFIX) {
+		for (field = 0; field < LIBRARY_NUM_FIELDS; field++) {
+			if (fields & (1 << field))
+				library_collect_sorted(library, field, text,
+						       FALSE, matches);
+		}
+	} else if (text && strlen(text) >= TRIGRAM_LEN) {
+		GPtrArray *posting = library_posting(library, text);
+
+		for (i = 0; posting && i < posting->len; i++)
+			g_ptr_array_add(matches, posting->pdata[i]);
+	} else if (genre) {
+		library_collect_sorted(library, LIBRARY_GENRE, genre, TRUE, matches);
+	} else {
+		GHashTableIter iter;
+		gpointer entry;
+
+		g_hash_table_iter_init(&iter, library->entries);
+		while (g_hash_table_iter_next(&iter, NULL, &entry))
+			g_ptr_array_add(matches, entry);
+	}
+
+	g_ptr_array_sort(matches, entry_compare_id);
+
+	// filter in place, dropping entries found through several fields
+	for (i = 0; i < matches->len; i++) {
+		struct library_entry *entry = matches->pdata[i];
+
+		if (kept && matches->pdata[kept - 1] == entry)
+			continue;
+
+		if (entry_matches(entry, query, text, genre))
+			matches->pdata[kept++] = entry;
+	}
+
+	*total = kept;
+
+	results = g_ptr_array_new();
+	for (i = MAX(query->offset, 0); i < kept; i++) {
+		struct library_entry *entry = matches->pdata[i];
+
+		if (query->limit >= 0 && results->len >= (guint) query->limit)
+			break;
+
+		g_ptr_array_add(results, entry->item);
+	}
+
+	g_ptr_array_free(matches, TRUE);
+	g_free(genre);
+	g_free(text);
+
+	return results;
+}
+
+/* the group for @name below @parent, NULL if it has no tracks */
+static struct library_group *group_find(struct library_group *parent,
+					const char *name)
+{
+	gchar *key = library_fold(name ?: "");
+	struct library_group *group = g_hash_table_lookup(parent->lookup, key);
+
+	g_free(key);
+
+	return group;
+}
+
+static GSequenceIter *group_page(struct library_group *group, int offset)
+{
+	return g_sequence_get_iter_at_pos(group->children, MAX(offset, 0));
+}
+
+/*
+ * Returns the summaries of the artists when @artist is NULL, else of the
+ * albums of @artist, restricted to the page described by @offset and @limit.
+ * @total is set to the number of artists or albums across all pages. Returns
+ * NULL if @artist has no tracks.
+ */
+GArray *library_browse(struct library *library, const char *artist,
+		       int offset, int limit, int *total)
+{
+	struct library_group *parent = library->root;
+	GSequenceIter *iter;
+	GArray *results;
+
+	if (artist) {
+		parent = group_find(library->root, artist);
+		if (!parent)
+			return NULL;
+	}
+
+	*total = g_sequence_get_length(parent->children);
+	results = g_array_new(FALSE, FALSE, sizeof(struct library_summary));
+
+	for (iter = group_page(parent, offset);
+	     !g_sequence_iter_is_end(iter) && (limit < 0 || results->len < (guint) limit);
+	     iter = g_sequence_iter_next(iter)) {
+		struct library_group *group = g_sequence_get(iter);
+		struct library_summary summary = {
+			.name = group->name,
+			.albums = group->lookup ? g_hash_table_size(group->lookup) : 0,
+			.tracks = group->tracks,
+			.duration = group->duration,
+		};
+
+		g_array_append_val(results, summary);
+	}
+
+	return results;
+}
+
+/*
+ * Returns the items of @album by @artist in playlist order, restricted to the
+ * page described by @offset and @limit. @total is set to the number of
+ * tracks of the album. Returns NULL if the album has no tracks.
+ */
+GPtrArray *library_browse_tracks(struct library *library, const char *artist,
+				 const char *album, int offset, int limit,
+				 int *total)
+{
+	struct library_group *group;
+	GSequenceIter *iter;
+	GPtrArray *results;
+
+	group = group_find(library->root, artist);
+	if (group)
+		group = group_find(group, album);
+	if (!group)
+		return NULL;
+
+	*total = group->tracks;
+	results = g_ptr_array_new();
+
+	for (iter = group_page(group, offset);
+	     !g_sequence_iter_is_end(iter) && (limit < 0 || results->len < (guint) limit);
+	     iter = g_sequence_iter_next(iter)) {
+		struct library_entry *entry = g_sequence_get(iter);
+
+		g_ptr_array_add(results, entry->item);
+	}
+
+	return results;
+}
+
+/*
+ * Returns the first item in @order, which must not be the playlist order
+ * LIBRARY_ORDER_INDEX since the library does not keep it.
+ */
+struct playlist_item *library_first(struct library *library, int order)
+{
+	GSequenceIter *iter = g_sequence_get_begin_iter(library->orders[order]);
+	struct library_entry *entry;
+
+	if (g_sequence_iter_is_end(iter))
+		return NULL;
+
+	entry = g_sequence_get(iter);
+
+	return entry->item;
+}
+
+/*
+ * Returns the item following @item in @order, or preceding it unless
+ * @forward. Returns NULL at either end or if @item is not in @library.
+ */
+struct playlist_item *library_step(struct library *library, int order,
+				   struct playlist_item *item, gboolean forward)
+{
+	struct library_entry *entry = g_hash_table_lookup(library->entries, item);
+	GSequenceIter *iter;
+
+	if (!entry || !entry->ordered[order])
+		return NULL;
+
+	if (forward) {
+		iter = g_sequence_iter_next(entry->ordered[order]);
+		if (g_sequence_iter_is_end(iter))
+			return NULL;
+	} else {
+		if (g_sequence_iter_is_begin(entry->ordered[order]))
+			return NULL;
+		iter = g_sequence_iter_prev(entry->ordered[order]);
+	}
+
+	entry = g_sequence_get(iter);
+
+	return entry->item;
+}
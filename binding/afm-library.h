@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2017 Konsulko Group
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _AFM_LIBRARY_H
+#define _AFM_LIBRARY_H
+
+#include "afm-common.h"
+
+enum {
+    LIBRARY_TITLE = 0,
+    LIBRARY_ARTIST,
+    LIBRARY_ALBUM,
+    LIBRARY_GENRE,
+    LIBRARY_NUM_FIELDS
+};
+
+/* sort orders, LIBRARY_ORDER_INDEX is the playlist order */
+enum {
+    LIBRARY_ORDER_INDEX = 0,
+    LIBRARY_ORDER_TITLE,
+    LIBRARY_ORDER_ARTIST,
+    LIBRARY_ORDER_PATH,
+    LIBRARY_ORDER_DURATION,
+    LIBRARY_ORDER_ADDED,
+    LIBRARY_NUM_ORDERS
+};
+
+#define LIBRARY_TEXT_FIELDS \
+    ((1 << LIBRARY_TITLE) | (1 << LIBRARY_ARTIST) | (1 << LIBRARY_ALBUM))
+
+enum {
+    LIBRARY_MATCH_SUBSTRING = 0,
+    LIBRARY_MATCH_PREFIX,
+    LIBRARY_NUM_MATCHES
+};
+
+struct library_query {
+    const char *text;       /* matched against @fields, NULL for any */
+    int match;
+    guint fields;           /* mask of LIBRARY_TITLE, ARTIST and ALBUM */
+    const char *genre;      /* exact genre, NULL for any */
+    int offset;
+    int limit;
+};
+
+/* aggregates of an artist or an album, see library_browse() */
+struct library_summary {
+    const char *name;       /* owned by the library */
+    int albums;             /* albums of an artist, 0 for an album */
+    int tracks;
+    gint64 duration;        /* total of the known durations in milliseconds */
+};
+
+struct library;
+
+extern const char *library_fields[LIBRARY_NUM_FIELDS];
+extern const char *library_matches[LIBRARY_NUM_MATCHES];
+extern const char *library_orders[LIBRARY_NUM_ORDERS];
+
+struct library *library_new(void);
+void library_free(struct library *library);
+void library_add(struct library *library, struct playlist_item *item);
+void library_update(struct library *library, struct playlist_item *item);
+void library_remove(struct library *library, struct playlist_item *item);
+void library_clear(struct library *library);
+GPtrArray *library_search(struct library *library,
+                          const struct library_query *query, int *total);
+struct playlist_item *library_first(struct library *library, int order);
+struct playlist_item *library_step(struct library *library, int order,
+                                   struct playlist_item *item, gboolean forward);
+GArray *library_browse(struct library *library, const char *artist,
+                       int offset, int limit, int *total);
+GPtrArray *library_browse_tracks(struct library *library, const char *artist,
+                                 const char *album, int offset, int limit,
+                                 int *total);
+
+#endif /* _AFM_LIBRARY_H */
@@ -21,13 +21,20 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <glib.h>
 #include <gio/gio.h>
 #include <pthread.h>
 #include <gst/gst.h>
 #include <gst/tag/tag.h>
+#include <gst/pbutils/pbutils.h>
+#include <gst/controller/controller.h>
 #include <json-c/json.h>
 #include "afm-common.h"
+#include "afm-history.h"
+#include "afm-library.h"
 
 #define AFB_BINDING_VERSION 3
 #include <afb/afb-binding.h>
@@ -36,13 +43,41 @@
 // Wireplumber policy mechanism. Hopefully temporary.
 #define WIREPLUMBER_WORKAROUND
 
-static afb_event_t playlist_event;
-static afb_event_t metadata_event;
 static GMutex mutex;
 
+/* filtered metadata event channels, see metadata_push() */
+static GList *metadata_channels = NULL;
+static GMutex channel_mutex;
+
+/* guards the published state snapshot pointers, see state_snapshot_get() */
+static GMutex snapshot_mutex;
+
 static GList *playlist = NULL;
-static GList *metadata_track = NULL;
-static GList *current_track = NULL;
+
+/* last link of playlist, so that appending doesn't walk it */
+static GList *playlist_tail = NULL;
+
+/* media path -> playlist link */
+static GHashTable *playlist_paths = NULL;
+
+/* index number of the next playlist entry */
+static int playlist_next_id;
+
+/* last revision given to a playlist entry, bumped on every change */
+static guint playlist_revision;
+
+/* search indexes over the audio items of the playlist */
+static struct library *library = NULL;
+
+/* seek indexes of the files played, see seek_index_store() */
+static GKeyFile *seek_index_cache = NULL;
+
+/* files that failed to play, see track_failed() */
+static GKeyFile *bad_cache = NULL;
+
+/* plays and skips of the media paths, see history_track_end() */
+static struct history *history = NULL;
+static guint history_flush_id;
 
 static const char *signalcomposer_events[] = {
 	"event.media.next",
@@ -51,7 +86,117 @@ static const char *signalcomposer_events[] = {
 	NULL,
 };
 
-static json_object *populate_json_metadata(void);
+static void discovery_queue(struct playlist_item *item);
+static GPtrArray *discovery_chapters(const char *uri);
+static gboolean discovery_flush(gpointer user_data);
+
+/* kind of payload pushed on the metadata event */
+enum {
+	METADATA_POSITION,
+	METADATA_TRACK,
+	METADATA_ART,
+	METADATA_BLUETOOTH,
+	METADATA_SIGNAL,
+};
+
+/* fields a metadata subscriber can select, both root and "track" level */
+static const char * const METADATA_FIELDS[] = {
+	"position",
+	"volume",
+	"status",
+	"rate",
+	"buffering",
+	"path",
+	"title",
+	"album",
+	"artist",
+	"genre",
+	"duration",
+	"index",
+	"selected",
+	"image",
+	NULL,
+};
+
+#define METADATA_FIELDS_ALL	((1 << (G_N_ELEMENTS(METADATA_FIELDS) - 1)) - 1)
+
+struct metadata_channel {
+	afb_event_t event;
+	gchar *name;
+	struct _CustomData *zone;
+	guint fields;
+	gint64 interval;
+	gboolean art;
+	gboolean bluetooth;
+	gboolean signals;
+
+	/* monotonic time of the last position update, in microseconds */
+	gint64 last_position;
+};
+
+#define UNDERRUN_LATENESS_MS	20
+
+/* playbin GstPlayFlags, buffering of the demuxed data of streams */
+#define PLAY_FLAG_BUFFERING	(1 << 8)
+
+#define HISTORY_LOG		"history"
+#define HISTORY_BATCH		16	/* records written right away */
+#define HISTORY_FLUSH_SECONDS	60	/* delay before writing fewer records */
+#define HISTORY_PLAYED_MS	240000	/* heard for this long, a play */
+
+#define BAD_CACHE		"bad"
+#define TRACK_RETRIES		2	/* reloads of a failing track before skipping it */
+#define STALL_SECONDS		5	/* without progress while playing */
+
+#define SEEK_INDEX_CACHE	"seek-index"
+#define SEEK_INDEX_INTERVAL	5000	/* milliseconds between entries */
+#define SEEK_INDEX_TOLERANCE	1000	/* milliseconds the demuxer may be off */
+
+#define DISCOVERY_MAX_WORKERS	4
+#define ZONES_MAX		4
+
+/* scheduling of a class of threads, see thread_policy_apply() */
+struct thread_policy {
+	int policy;		/* SCHED_OTHER, SCHED_FIFO or SCHED_RR */
+	int priority;		/* real-time priority */
+	int nice;
+	gboolean set_nice;
+	cpu_set_t cpus;
+	gboolean set_cpus;
+};
+
+/* binding settings, may be overridden from the binder configuration */
+static struct {
+	int discovery_workers;
+	gboolean normalize;
+	gint64 crossfade;
+	gint64 ingest_window;
+	gint64 idle_release;
+	int sink_profile;
+	gint buffer_size;		/* bytes */
+	gint64 buffer_duration;		/* milliseconds */
+	int buffer_low_watermark;	/* percent */
+	int buffer_high_watermark;	/* percent */
+	struct thread_policy loop_thread;
+	struct thread_policy streaming_threads;
+	struct {
+		gchar *name;
+		gchar *role;
+	} zones[ZONES_MAX];
+	int num_zones;
+} settings = {
+	.discovery_workers = 1,
+	.normalize = FALSE,
+	.crossfade = 0,
+	.ingest_window = 250,
+	.idle_release = 30,
+	.buffer_size = 2 * 1024 * 1024,
+	.buffer_duration = 5000,
+	.buffer_low_watermark = 10,
+	.buffer_high_watermark = 99,
+	.zones = { { "default", "Multimedia" } },
+	.num_zones = 1,
+};
 
 enum {
         LOOP_OFF,
@@ -66,27 +211,212 @@ static const char * const LOOP_STATES[LOOP_NUM_TYPES] = {
         "track",
 };
 
+enum {
+	PLAYLIST_FORMAT_JSON,
+	PLAYLIST_FORMAT_COMPACT,
+	PLAYLIST_NUM_FORMATS,
+};
+
+static const char * const PLAYLIST_FORMATS[PLAYLIST_NUM_FORMATS] = {
+	"json",
+	"compact",
+};
+
+/* output buffering of a zone, see sink_profile_apply() */
+enum {
+	SINK_PROFILE_DEFAULT,
+	SINK_PROFILE_LOW_LATENCY,
+	SINK_PROFILE_POWER_SAVE,
+	SINK_NUM_PROFILES,
+};
+
+static const struct {
+	const char *name;
+	const char *quantum;	/* PipeWire node.latency, NULL for the graph's */
+	gint64 deadline;	/* sink processing deadline in milliseconds */
+} SINK_PROFILES[SINK_NUM_PROFILES] = {
+	{ "default", NULL, 20 },
+	{ "low-latency", "256/48000", 5 },
+	{ "power-save", "8192/48000", 100 },
+};
+
+/* pipeline fading out during a crossfade, see crossfade_start() */
+struct crossfade {
+	GstElement *playbin, *audio_sink, *audio_filter;
+	GstBus *bus;
+	gint64 duration;
+	gint64 cpu_start;
+	guint timeout_id;
+	GList *failed;		/* track failing to crossfade, only compared */
+};
+
+/*
+ * Stream position kept from the pipeline clock: it is sampled with a single
+ * query whenever the pipeline settles after prerolling, seeking or changing
+ * state, and extrapolated from the clock while running. Reading it needs
+ * neither a pipeline query nor mutex, see position_get().
+ */
+struct position_clock {
+	GMutex lock;
+	GstClock *clock;	/* set while running */
+	GstClockTime clock_time;	/* clock time when sampled */
+	gint64 stream_time;	/* position when sampled, -1 if unknown */
+	gdouble rate;
+};
+
+/* stream time reached by the fader of a pipeline, see fader_probe() */
+struct fader_sync {
+	GMutex lock;
+	GstSegment segment;	/* of the buffers out of the fader */
+	gint64 stream_time;	/* where the next buffer starts, -1 if unknown */
+};
+
+/* published state of a zone, see state_publish() */
+struct state_snapshot {
+	gint refcount;
+	gboolean playing;
+	gboolean corked;
+	int loop_state;
+	int order;
+	long int volume;
+	gdouble rate;
+	gboolean normalize;
+	gint64 crossfade;
+	gboolean avrcp_connected;
+
+	/* selected track entry, NULL without a playlist */
+	json_object *track;
+	guint track_revision;	/* revision of the track entry, 0 without */
+	gint64 track_duration;
+};
+
+/* state change waiting for a fade out, see fade_out() */
+struct fade {
+	GstState state;
+	guint timeout_id;
+};
+
+/* track start waiting for the preroll, see set_media_uri_at() */
+struct start {
+	gint64 position;	/* milliseconds, -1 once issued */
+	gboolean playing;
+};
+
+/* byte offset read at a stream position, see seek_index_sample() */
+struct seek_entry {
+	gint64 time;		/* milliseconds */
+	gint64 offset;
+};
+
+/* seek index of the file played by a zone */
+struct seek_index {
+	gchar *uri;		/* NULL unless a local file */
+	GArray *entries;	/* struct seek_entry sampled while playing */
+	gboolean linear;	/* played from the start without seeking */
+	gint64 shift;		/* true minus pipeline time after an indexed seek */
+};
+
+/* pipeline release of an idle zone, see idle_release() */
+struct idle {
+	gint64 since;		/* monotonic time when last seen active */
+	gboolean released;
+	gint64 resume_start;	/* monotonic time a resume was requested, 0 if none */
+	guint position_id;	/* position_event() timer, 0 while released */
+};
+
+/* recovery of a track failing to play, see track_failed() */
+struct recovery {
+	GList *track;		/* track last failing, only compared */
+	int retries;
+	gint buffers;		/* reaching the audio sink, counted atomically */
+	gint checked;		/* buffers at the last check */
+	int stalled;		/* seconds without progress */
+};
+
+/* part of the file played for a chapter, see segment_set() */
+struct segment {
+	gint64 start;		/* nanoseconds */
+	gint64 stop;		/* nanoseconds, -1 up to the end of the file */
+};
+
+/*
+ * Playback zone: each one has its own pipeline, PipeWire stream role,
+ * position in the shared playlist and events. All state is protected by
+ * mutex.
+ */
 typedef struct _CustomData {
+	const gchar *name;
+	const gchar *role;
+	GList *current_track;
+	afb_event_t metadata_event;
+	afb_event_t playlist_event;
+	afb_event_t playlist_compact_event;
+
+	/* cleared once nobody listens to the compact playlist event */
+	gboolean playlist_compact_listeners;
+	guint playlist_compact_subscribes;	/* subscriptions to it so far */
+
 	GstElement *playbin, *fake_sink, *audio_sink;
+	GstElement *audio_filter, *rgvolume, *rglimiter, *fader;
+	GstControlSource *fader_cs;
+	struct fader_sync *fader_sync;	/* owned by the fader */
+	GstBus *bus;
 	gboolean playing;
 	int loop_state;
+	int order;		/* playback order, see playlist_step() */
+	int profile;		/* output buffering, see SINK_PROFILES */
 	gboolean corked;
 	gboolean one_time;
+	gboolean normalize;
+	gint64 crossfade;
 	long int volume;
-	gint64 position;
+	struct position_clock position;
 	gint64 duration;
+	gdouble rate;
+	int buffering;		/* percent of a stream buffered, 100 unless refilling */
+	struct crossfade outgoing;
+	struct fade fade;
+	struct start start;
+	struct segment segment;
+	struct seek_index index;
+	struct idle idle;
+	struct recovery recovery;
+	struct state_snapshot *snapshot;
 	afb_api_t api;
 
-	/* avrcp */
+	/* avrcp, only ever connected to the first zone */
 	gboolean avrcp_connected;
 } CustomData;
 
-CustomData data = {
-	.volume = 50,
-	.corked = FALSE,
-	.position = GST_CLOCK_TIME_NONE,
-	.duration = GST_CLOCK_TIME_NONE,
-};
+/* the first zone is the one addressed by requests naming none */
+static CustomData zones[ZONES_MAX];
+static int num_zones;
+
+/* runtime statistics, reported by the metrics verb */
+static struct {
+	guint crossfades;
+	gint64 crossfade_cpu;
+	gint64 crossfade_cpu_total;
+	guint ingest_events;
+	guint ingest_passes;
+	guint idle_releases;
+	guint idle_resumes;
+	gint64 resume_latency;
+	gint64 resume_latency_max;
+	guint underruns;
+	guint rebuffers;
+	guint errors;
+	guint stalls;
+	guint skips;
+} stats;
+
+static gboolean handle_message(GstBus *bus, GstMessage *msg, CustomData *data);
+static gboolean position_event(CustomData *data);
+static json_object *populate_json_metadata(CustomData *data);
+static void loudness_setup(CustomData *data, GList *track);
+static void audio_filter_normalize(CustomData *data, gboolean normalize);
+static void metadata_push(CustomData *data, json_object *jresp, int kind);
+static void state_publish(CustomData *data);
 
 
 static int find_loop_state_idx(const char *state)
@@ -105,291 +435,2986 @@ static int find_loop_state_idx(const char *state)
 	return 0;
 }
 
-static void mediaplayer_set_role_state(afb_api_t api, int state)
+static int find_playlist_format_idx(const char *format)
 {
-	data.playing = (state == GST_STATE_PLAYING);
-	gst_element_set_state(data.playbin, state);
+	int idx;
+
+	if (!format)
+		return PLAYLIST_FORMAT_JSON;
+
+	for (idx = 0; idx < PLAYLIST_NUM_FORMATS; idx++) {
+		if (!g_strcmp0(PLAYLIST_FORMATS[idx], format))
+			return idx;
+	}
+
+	return -EINVAL;
 }
 
-static json_object *populate_json(struct playlist_item *track)
+static int find_sink_profile_idx(const char *profile)
 {
-	json_object *jresp = json_object_new_object();
-	json_object *jstring = json_object_new_string(track->media_path);
-	json_object_object_add(jresp, "path", jstring);
+	int idx;
 
-	if (track->title) {
-		jstring = json_object_new_string(track->title);
-		json_object_object_add(jresp, "title", jstring);
+	for (idx = 0; idx < SINK_NUM_PROFILES; idx++) {
+		if (!g_strcmp0(SINK_PROFILES[idx].name, profile))
+			return idx;
 	}
 
-	if (track->album) {
-		jstring = json_object_new_string(track->album);
-		json_object_object_add(jresp, "album", jstring);
-	}
+	return -EINVAL;
+}
 
-	if (track->artist) {
-		jstring = json_object_new_string(track->artist);
-		json_object_object_add(jresp, "artist", jstring);
-	}
+/* sort order named @order, @fallback if @order is NULL */
+static int find_playlist_order_idx(const char *order, int fallback)
+{
+	int idx;
 
-	if (track->genre) {
-		jstring = json_object_new_string(track->genre);
-		json_object_object_add(jresp, "genre", jstring);
+	if (!order)
+		return fallback;
+
+	for (idx = 0; idx < LIBRARY_NUM_ORDERS; idx++) {
+		if (!g_strcmp0(library_orders[idx], order))
+			return idx;
 	}
 
-	if (track->duration > 0)
-		json_object_object_add(jresp, "duration",
-			       json_object_new_int64(track->duration));
+	return -EINVAL;
+}
 
-	json_object_object_add(jresp, "index",
-			       json_object_new_int(track->id));
+/* zone named @name, the first one if @name is NULL */
+static CustomData *zone_find(const char *name)
+{
+	int idx;
 
-	if (current_track && current_track->data)
-		json_object_object_add(jresp, "selected",
-			json_object_new_boolean(track == current_track->data));
+	if (!name)
+		return &zones[0];
 
-	return jresp;
+	for (idx = 0; idx < num_zones; idx++) {
+		if (!g_strcmp0(zones[idx].name, name))
+			return &zones[idx];
+	}
+
+	return NULL;
 }
 
-static gboolean populate_from_json(struct playlist_item *item, json_object *jdict)
+/* events of the first zone keep their plain name, others are prefixed */
+static gchar *zone_event_name(CustomData *data, const char *name)
 {
-	gboolean ret;
-	json_object *val = NULL;
+	if (data == &zones[0])
+		return g_strdup(name);
 
-	ret = json_object_object_get_ex(jdict, "path", &val);
-	if (!ret)
-		return ret;
-	item->media_path = g_strdup(json_object_get_string(val));
+	return g_strdup_printf("%s.%s", data->name, name);
+}
 
-	ret = json_object_object_get_ex(jdict, "type", &val);
-	if (!ret) {
-		g_free(item->media_path);
-		return ret;
-	}
-	item->media_type = g_strdup(json_object_get_string(val));
+#define VOLUME_RAMP_MS	100
+#define FADE_MS		300
 
-	ret = json_object_object_get_ex(jdict, "title", &val);
-	if (ret) {
-		item->title = g_strdup(json_object_get_string(val));
+/*
+ * Volume changes go through the fader of the audio filter: its volume is
+ * driven by an interpolation control source, so ramps are computed per
+ * sample in the streaming thread from the control points set here. Control
+ * points are in stream time, each pipeline has its own. Without a fader the
+ * playbin volume is set directly.
+ */
+static void fader_set(GstElement *playbin, GstControlSource *cs, gdouble level)
+{
+	GstTimedValueControlSource *tvcs = GST_TIMED_VALUE_CONTROL_SOURCE(cs);
+
+	if (!cs) {
+		g_object_set(playbin, "volume", level, NULL);
+		return;
 	}
 
-	ret = json_object_object_get_ex(jdict, "album", &val);
-	if (ret) {
-		item->album = g_strdup(json_object_get_string(val));
+	gst_timed_value_control_source_unset_all(tvcs);
+	gst_timed_value_control_source_set(tvcs, 0, level);
+}
+
+/*
+ * Control values are synced on the buffers going through the fader, which
+ * the streaming thread processes ahead of the sink by its latency. A probe
+ * on the fader output keeps the stream time it got to, so that ramps start
+ * from there rather than from the position heard, which it is already past.
+ */
+static GstPadProbeReturn fader_probe(GstPad *pad, GstPadProbeInfo *info,
+				     gpointer user_data)
+{
+	struct fader_sync *sync = user_data;
+	GstBuffer *buffer;
+	GstEvent *event;
+	GstClockTime time;
+
+	if (info->type & GST_PAD_PROBE_TYPE_BUFFER) {
+		buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+		if (!GST_BUFFER_PTS_IS_VALID(buffer))
+			return GST_PAD_PROBE_OK;
+
+		g_mutex_lock(&sync->lock);
+
+		// the next buffer starts where this one ends, or begins in reverse
+		time = GST_BUFFER_PTS(buffer);
+		if (sync->segment.rate > 0 && GST_BUFFER_DURATION_IS_VALID(buffer))
+			time += GST_BUFFER_DURATION(buffer);
+
+		time = gst_segment_to_stream_time(&sync->segment, GST_FORMAT_TIME,
+						  time);
+		sync->stream_time = GST_CLOCK_TIME_IS_VALID(time) ? (gint64) time : -1;
+
+		g_mutex_unlock(&sync->lock);
+		return GST_PAD_PROBE_OK;
 	}
 
-	ret = json_object_object_get_ex(jdict, "artist", &val);
-	if (ret) {
-		item->artist = g_strdup(json_object_get_string(val));
+	event = GST_PAD_PROBE_INFO_EVENT(info);
+
+	g_mutex_lock(&sync->lock);
+
+	if (GST_EVENT_TYPE(event) == GST_EVENT_SEGMENT) {
+		gst_event_copy_segment(event, &sync->segment);
+		sync->stream_time = -1;
+	} else if (GST_EVENT_TYPE(event) == GST_EVENT_FLUSH_STOP) {
+		sync->stream_time = -1;
 	}
 
-	ret = json_object_object_get_ex(jdict, "genre", &val);
-	if (ret) {
-		item->genre = g_strdup(json_object_get_string(val));
+	g_mutex_unlock(&sync->lock);
+
+	return GST_PAD_PROBE_OK;
+}
+
+static void fader_sync_free(struct fader_sync *sync)
+{
+	g_mutex_clear(&sync->lock);
+	g_free(sync);
+}
+
+static struct fader_sync *fader_sync_new(GstElement *fader)
+{
+	struct fader_sync *sync = g_new0(struct fader_sync, 1);
+	GstPad *pad = gst_element_get_static_pad(fader, "src");
+
+	g_mutex_init(&sync->lock);
+	gst_segment_init(&sync->segment, GST_FORMAT_TIME);
+	sync->stream_time = -1;
+
+	// freed along with the fader
+	gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER |
+			  GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM |
+			  GST_PAD_PROBE_TYPE_EVENT_FLUSH,
+			  fader_probe, sync, (GDestroyNotify) fader_sync_free);
+	gst_object_unref(pad);
+
+	return sync;
+}
+
+/*
+ * Stream time a ramp of @playbin starts from, the one its fader reached as
+ * kept in @sync, and in @lead how far it is ahead of the position heard.
+ */
+static gint64 fader_anchor(GstElement *playbin, struct fader_sync *sync,
+			   gint64 *lead)
+{
+	gint64 position = 0, synced = -1;
+
+	if (!gst_element_query_position(playbin, GST_FORMAT_TIME, &position))
+		position = 0;
+
+	if (sync) {
+		g_mutex_lock(&sync->lock);
+		synced = sync->stream_time;
+		g_mutex_unlock(&sync->lock);
 	}
 
-	ret = json_object_object_get_ex(jdict, "duration", &val);
-	if (ret) {
-		item->duration = json_object_get_int64(val);
+	*lead = synced > position ? synced - position : 0;
+
+	return position + *lead;
+}
+
+/*
+ * Ramp from the current level to @level over @duration ms of playback, from
+ * where the fader kept in @sync got to. Returns the ms before the ramp starts
+ * being heard.
+ */
+static gint64 fader_ramp(GstElement *playbin, GstControlSource *cs,
+			 struct fader_sync *sync, gdouble level,
+			 gint64 duration)
+{
+	GstTimedValueControlSource *tvcs = GST_TIMED_VALUE_CONTROL_SOURCE(cs);
+	gint64 position, lead = 0;
+	gdouble current = level;
+
+	if (!cs || duration <= 0) {
+		fader_set(playbin, cs, level);
+		return 0;
 	}
 
+	position = fader_anchor(playbin, sync, &lead);
+	gst_control_source_get_value(cs, position, &current);
+
+	gst_timed_value_control_source_unset_all(tvcs);
+	gst_timed_value_control_source_set(tvcs, 0, current);
+	gst_timed_value_control_source_set(tvcs, position, current);
+	gst_timed_value_control_source_set(tvcs, position + duration * GST_MSECOND,
+					   level);
+
+	return lead / GST_MSECOND;
+}
+
+/* stream time is about to jump, hold the level a ramp was heading to */
+static void fader_rebase(GstElement *playbin, GstControlSource *cs)
+{
+	gdouble level;
+
+	if (cs && gst_control_source_get_value(cs, G_MAXINT64, &level))
+		fader_set(playbin, cs, level);
+}
+
+/*
+ * Pausing and stopping fade the stream out first, the state change then
+ * happens from a timeout once the ramp has played out. Any other state
+ * change cancels it.
+ */
+static gboolean fade_cancel(CustomData *data)
+{
+	if (!data->fade.timeout_id)
+		return FALSE;
+
+	g_source_remove(data->fade.timeout_id);
+	data->fade.timeout_id = 0;
+
 	return TRUE;
 }
 
-static int set_media_uri(struct playlist_item *item, int state)
+static gboolean fade_out_done(CustomData *data)
 {
-	if (!item || !item->media_path)
-	{
-		AFB_ERROR("Failed to set media URI: no item provided!");
-		return -ENOENT;
+	g_mutex_lock(&mutex);
+
+	data->fade.timeout_id = 0;
+	gst_element_set_state(data->playbin, data->fade.state);
+	AFB_DEBUG("GSTREAMER playbin.state = %s",
+		  gst_element_state_get_name(data->fade.state));
+
+	g_mutex_unlock(&mutex);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void start_cancel(CustomData *data)
+{
+	data->start.position = -1;
+	data->start.playing = FALSE;
+}
+
+/* fade out then move the playbin to @state, right away if nothing is heard */
+static void fade_out(CustomData *data, GstState state)
+{
+	GstState current = GST_STATE_NULL;
+	gint64 lead;
+
+	fade_cancel(data);
+	start_cancel(data);
+
+	gst_element_get_state(data->playbin, &current, NULL, 0);
+	if (current != GST_STATE_PLAYING || !data->fader_cs) {
+		gst_element_set_state(data->playbin, state);
+		AFB_DEBUG("GSTREAMER playbin.state = %s",
+			  gst_element_state_get_name(state));
+		return;
 	}
 
-	gst_element_set_state(data.playbin, GST_STATE_NULL);
-	AFB_DEBUG("GSTREAMER playbin.state = GST_STATE_NULL");
+	lead = fader_ramp(data->playbin, data->fader_cs, data->fader_sync, 0.0,
+			  FADE_MS);
 
-	g_object_set(data.playbin, "uri", item->media_path, NULL);
-	AFB_DEBUG("GSTREAMER playbin.uri = %s", item->media_path);
+	data->fade.state = state;
+	data->fade.timeout_id = g_timeout_add(FADE_MS + lead,
+			(GSourceFunc) fade_out_done, data);
+}
 
-	data.position = GST_CLOCK_TIME_NONE;
-	data.duration = GST_CLOCK_TIME_NONE;
+/* move the playbin to PLAYING and fade in to the user volume */
+static void fade_in(CustomData *data)
+{
+	// an interrupted fade out ramps back up from where it got
+	if (!fade_cancel(data))
+		fader_set(data->playbin, data->fader_cs, 0.0);
 
-	if (state) {
-		g_object_set(data.playbin, "audio-sink", data.audio_sink, NULL);
-		AFB_DEBUG("GSTREAMER playbin.audio-sink = pipewire-sink");
+	gst_element_set_state(data->playbin, GST_STATE_PLAYING);
+	AFB_DEBUG("GSTREAMER playbin.state = GST_STATE_PLAYING");
 
-		if (!data.playing)
-			mediaplayer_set_role_state(data.api, GST_STATE_PLAYING);
-		else
-			gst_element_set_state(data.playbin, GST_STATE_PLAYING);
+	fader_ramp(data->playbin, data->fader_cs, data->fader_sync,
+		   (double) data->volume / 100.0, FADE_MS);
+}
 
-		AFB_DEBUG("GSTREAMER playbin.state = GST_STATE_PLAYING");
-	} else {
-		g_object_set(data.playbin, "audio-sink", data.fake_sink, NULL);
-		AFB_DEBUG("GSTREAMER playbin.audio-sink = fake-sink");
+/* current stream position in nanoseconds, -1 if unknown */
+static gint64 position_stream(CustomData *data)
+{
+	struct position_clock *pc = &data->position;
+	gint64 position;
 
-#ifdef WIREPLUMBER_WORKAROUND
-		gst_element_set_state(data.playbin, GST_STATE_READY);
-		AFB_DEBUG("GSTREAMER playbin.state = GST_STATE_READY");
-#else
-		gst_element_set_state(data.playbin, GST_STATE_PAUSED);
-		AFB_DEBUG("GSTREAMER playbin.state = GST_STATE_PAUSED");
-#endif
+	g_mutex_lock(&pc->lock);
+
+	position = pc->stream_time;
+	if (pc->clock && position >= 0) {
+		position += (gint64) ((gst_clock_get_time(pc->clock) -
+				       pc->clock_time) * pc->rate);
+		position = MAX(position, 0);
 	}
-	// We can't be corked at this point
-	data.corked = FALSE;
 
-	double vol = (double) data.volume / 100.0;
-	g_object_set(data.playbin, "volume", vol, NULL);
-	AFB_DEBUG("GSTREAMER playbin.volume = %f", vol);
+	g_mutex_unlock(&pc->lock);
 
-	return 0;
+	return position;
 }
 
+/* position within the current track in nanoseconds, -1 if unknown */
+static gint64 position_get(CustomData *data)
+{
+	gint64 position = position_stream(data);
+
+	return position < 0 ? position : MAX(position - data->segment.start, 0);
+}
 
-static int in_list(gconstpointer item, gconstpointer list)
+/* restart from stream @position, running on @clock at @rate if set */
+static void position_set(CustomData *data, gint64 position, GstClock *clock,
+			 gdouble rate)
 {
-	return g_strcmp0(((struct playlist_item *) item)->media_path,
-			 ((struct playlist_item *) list)->media_path);
+	struct position_clock *pc = &data->position;
+
+	g_mutex_lock(&pc->lock);
+
+	if (pc->clock)
+		gst_object_unref(pc->clock);
+
+	pc->clock = clock;
+	pc->clock_time = clock ? gst_clock_get_time(clock) : GST_CLOCK_TIME_NONE;
+	pc->stream_time = position;
+	pc->rate = rate;
+
+	g_mutex_unlock(&pc->lock);
 }
 
-static void populate_playlist(json_object *jquery)
+/* sample the position of a pipeline that just settled, mutex held */
+static void position_sample(CustomData *data)
 {
-	int i, idx = 0;
-	GList *list = g_list_last(playlist);
+	GstState state = GST_STATE_NULL;
+	gint64 position;
 
-	if (list && list->data) {
-		struct playlist_item *item = list->data;
-		idx = item->id + 1;
-	}
+	if (gst_element_query_position(data->playbin, GST_FORMAT_TIME, &position))
+		position += data->index.shift;
+	else
+		position = position_stream(data);
 
-	for (i = 0; i < json_object_array_length(jquery); i++) {
-		json_object *jdict = json_object_array_get_idx(jquery, i);
-		struct playlist_item *item = g_malloc0(sizeof(*item));
+	gst_element_get_state(data->playbin, &state, NULL, 0);
+
+	position_set(data, position, state == GST_STATE_PLAYING ?
+		     gst_element_get_clock(data->playbin) : NULL, data->rate);
+}
+
+/*
+ * Seeking in files without a seek table, such as VBR MP3 lacking a Xing or
+ * VBRI header, either scans the file or lands where the demuxer estimates
+ * from the average bitrate. While a file plays from its start without
+ * seeking, timestamps are exact, so the byte offset read is sampled every
+ * SEEK_INDEX_INTERVAL to build a table cached per file, which later seeks
+ * into it use to find where their target really is.
+ */
+
+/* sample the byte offset of the stream, mutex held */
+static void seek_index_sample(CustomData *data)
+{
+	struct seek_index *index = &data->index;
+	gint64 position = position_stream(data);
+	struct seek_entry entry;
+
+	if (!index->uri || !index->linear || data->rate != 1.0 || position < 0)
+		return;
+
+	entry.time = position / GST_MSECOND;
+	if (index->entries->len) {
+		struct seek_entry *last = &g_array_index(index->entries,
+				struct seek_entry, index->entries->len - 1);
+
+		if (entry.time < last->time + SEEK_INDEX_INTERVAL)
+			return;
+	}
+
+	if (!gst_element_query_position(data->playbin, GST_FORMAT_BYTES,
+					&entry.offset) ||
+	    entry.offset <= 0 || entry.offset > G_MAXINT)
+		return;
+
+	g_array_append_val(index->entries, entry);
+}
+
+/* cache the index built for the file played, unless a longer one is */
+static void seek_index_store(CustomData *data)
+{
+	struct seek_index *index = &data->index;
+	gsize num = 0, i;
+	gint *times, *offsets;
+
+	if (!index->uri || index->entries->len < 2)
+		goto out;
+
+	if (media_cache_lookup(seek_index_cache, index->uri))
+		g_free(g_key_file_get_integer_list(seek_index_cache, index->uri,
+						   "time", &num, NULL));
+	if (num >= index->entries->len)
+		goto out;
+
+	times = g_new(gint, index->entries->len);
+	offsets = g_new(gint, index->entries->len);
+
+	for (i = 0; i < index->entries->len; i++) {
+		struct seek_entry *entry = &g_array_index(index->entries,
+							  struct seek_entry, i);
+
+		times[i] = entry->time;
+		offsets[i] = entry->offset;
+	}
+
+	media_cache_stamp(seek_index_cache, index->uri);
+	g_key_file_set_integer_list(seek_index_cache, index->uri, "time",
+				    times, index->entries->len);
+	g_key_file_set_integer_list(seek_index_cache, index->uri, "offset",
+				    offsets, index->entries->len);
+
+	if (!media_cache_save(seek_index_cache, SEEK_INDEX_CACHE))
+		AFB_WARNING("Cannot save seek index cache");
+
+	g_free(offsets);
+	g_free(times);
+out:
+	g_array_set_size(index->entries, 0);
+}
+
+/* start indexing @uri, keeping the index of the file played so far */
+static void seek_index_reset(CustomData *data, const char *uri)
+{
+	struct seek_index *index = &data->index;
+
+	seek_index_store(data);
+
+	g_free(index->uri);
+	index->uri = g_str_has_prefix(uri, "file://") ? g_strdup(uri) : NULL;
+	index->linear = TRUE;
+	index->shift = 0;
+}
+
+/*
+ * Difference in nanoseconds between the true time @position milliseconds
+ * into the file played and the time the pipeline gives the byte offset
+ * indexed for it, 0 without an index covering @position or when the
+ * demuxer is close enough.
+ */
+static gint64 seek_index_shift(CustomData *data, gint64 position)
+{
+	const char *uri = data->index.uri;
+	gsize num = 0, num_offsets = 0, i;
+	gint64 prev_time = 0, prev_offset = 0, offset, time, shift = 0;
+	gint *times, *offsets;
+
+	if (!uri || position <= 0 || !media_cache_lookup(seek_index_cache, uri))
+		return 0;
+
+	times = g_key_file_get_integer_list(seek_index_cache, uri, "time",
+					    &num, NULL);
+	offsets = g_key_file_get_integer_list(seek_index_cache, uri, "offset",
+					      &num_offsets, NULL);
+
+	if (!times || !offsets || num != num_offsets || position > times[num - 1])
+		goto out;
+
+	// interpolate between the entries around @position, from the start
+	for (i = 0; times[i] < position; i++) {
+		prev_time = times[i];
+		prev_offset = offsets[i];
+	}
+
+	offset = prev_offset + (offsets[i] - prev_offset) *
+		 (position - prev_time) / MAX(times[i] - prev_time, 1);
+
+	if (gst_element_query_convert(data->playbin, GST_FORMAT_BYTES, offset,
+				      GST_FORMAT_TIME, &time))
+		shift = position * GST_MSECOND - time;
+
+	if (ABS(shift) < SEEK_INDEX_TOLERANCE * GST_MSECOND)
+		shift = 0;
+out:
+	g_free(offsets);
+	g_free(times);
+
+	return shift;
+}
+
+/* length of the current track in nanoseconds, -1 if unknown */
+static gint64 track_duration(CustomData *data)
+{
+	if (data->segment.stop >= 0)
+		return data->segment.stop - data->segment.start;
+
+	if (!GST_CLOCK_TIME_IS_VALID(data->duration))
+		gst_element_query_duration(data->playbin, GST_FORMAT_TIME,
+					   &data->duration);
+
+	if (!GST_CLOCK_TIME_IS_VALID(data->duration))
+		return -1;
+
+	return MAX(data->duration - data->segment.start, 0);
+}
+
+/*
+ * Duration of @track in milliseconds as reported while it is the current
+ * track of zone @data, the pipeline's one once known. Every report of the
+ * selected track uses it so they all agree.
+ */
+static gint64 selected_duration(CustomData *data, struct playlist_item *track)
+{
+	gint64 duration = track_duration(data);
+
+	return duration >= 0 ? duration / GST_MSECOND : track->duration;
+}
+
+/* restrict playback to the part of the file @item refers to */
+static void segment_set(CustomData *data, struct playlist_item *item)
+{
+	data->segment.start = item->start * GST_MSECOND;
+	data->segment.stop = item->end > 0 ? item->end * GST_MSECOND : -1;
+}
+
+/*
+ * Flush seek to @position milliseconds into the current track, through the
+ * seek index when seeking within a whole file.
+ */
+static gboolean segment_seek(CustomData *data, gint64 position)
+{
+	GstSeekFlags flags = GST_SEEK_FLAG_FLUSH;
+	gint64 target = data->segment.start + position * GST_MSECOND;
+
+	data->index.shift = 0;
+
+	// chapter boundaries must not snap to the closest key unit
+	if (data->segment.start > 0 || data->segment.stop >= 0) {
+		flags |= GST_SEEK_FLAG_ACCURATE;
+	} else {
+		flags |= GST_SEEK_FLAG_KEY_UNIT;
+		data->index.shift = seek_index_shift(data, position);
+		target -= data->index.shift;
+	}
+
+	data->index.linear = target == 0;
+
+	// always set the stop, a rewind leaves its start position there
+	return gst_element_seek(data->playbin, 1.0, GST_FORMAT_TIME, flags,
+				GST_SEEK_TYPE_SET, target,
+				GST_SEEK_TYPE_SET, data->segment.stop >= 0 ?
+				data->segment.stop : GST_CLOCK_TIME_NONE);
+}
+
+static void mediaplayer_set_role_state(CustomData *data, int state)
+{
+	fade_cancel(data);
+	start_cancel(data);
+	data->playing = (state == GST_STATE_PLAYING);
+	gst_element_set_state(data->playbin, state);
+}
+
+static json_object *populate_json_fields(struct playlist_item *track,
+					gint64 duration, gboolean selected)
+{
+	json_object *jresp = json_object_new_object();
+	json_object *jstring = json_object_new_string(track->media_path);
+	json_object_object_add(jresp, "path", jstring);
+
+	if (track->title) {
+		jstring = json_object_new_string(track->title);
+		json_object_object_add(jresp, "title", jstring);
+	}
+
+	if (track->album) {
+		jstring = json_object_new_string(track->album);
+		json_object_object_add(jresp, "album", jstring);
+	}
+
+	if (track->artist) {
+		jstring = json_object_new_string(track->artist);
+		json_object_object_add(jresp, "artist", jstring);
+	}
+
+	if (track->genre) {
+		jstring = json_object_new_string(track->genre);
+		json_object_object_add(jresp, "genre", jstring);
+	}
+
+	if (duration > 0)
+		json_object_object_add(jresp, "duration",
+			       json_object_new_int64(duration));
+
+	json_object_object_add(jresp, "index",
+			       json_object_new_int(track->id));
+
+	json_object_object_add(jresp, "selected",
+			       json_object_new_boolean(selected));
+
+	return jresp;
+}
+
+/* the selected track reports the duration of the pipeline once known */
+static json_object *populate_json_selected(CustomData *data,
+					   struct playlist_item *track)
+{
+	return populate_json_fields(track, selected_duration(data, track), TRUE);
+}
+
+static json_object *populate_json(CustomData *data, struct playlist_item *track)
+{
+	if (data->current_track && track == data->current_track->data)
+		return populate_json_selected(data, track);
+
+	return populate_json_fields(track, track->duration, FALSE);
+}
+
+static gboolean populate_from_json(struct playlist_item *item, json_object *jdict)
+{
+	gboolean ret;
+	json_object *val = NULL;
+
+	ret = json_object_object_get_ex(jdict, "path", &val);
+	if (!ret)
+		return ret;
+	item->media_path = g_strdup(json_object_get_string(val));
+
+	ret = json_object_object_get_ex(jdict, "type", &val);
+	if (!ret) {
+		g_free(item->media_path);
+		return ret;
+	}
+	item->media_type = g_strdup(json_object_get_string(val));
+
+	ret = json_object_object_get_ex(jdict, "title", &val);
+	if (ret) {
+		item->title = g_strdup(json_object_get_string(val));
+	}
+
+	ret = json_object_object_get_ex(jdict, "album", &val);
+	if (ret) {
+		item->album = g_strdup(json_object_get_string(val));
+	}
+
+	ret = json_object_object_get_ex(jdict, "artist", &val);
+	if (ret) {
+		item->artist = g_strdup(json_object_get_string(val));
+	}
+
+	ret = json_object_object_get_ex(jdict, "genre", &val);
+	if (ret) {
+		item->genre = g_strdup(json_object_get_string(val));
+	}
+
+	ret = json_object_object_get_ex(jdict, "duration", &val);
+	if (ret) {
+		item->duration = json_object_get_int64(val);
+	}
+
+	return TRUE;
+}
+
+/* file played for @item, chapters share the one of their album */
+static const char *playlist_item_uri(struct playlist_item *item)
+{
+	return item->uri ? item->uri : item->media_path;
+}
+
+/* TRUE if @a and @b are chapters of the same file */
+static gboolean playlist_item_same_file(struct playlist_item *a,
+					struct playlist_item *b)
+{
+	return a && b && a->uri && !g_strcmp0(a->uri, b->uri);
+}
+
+/* the zone is in use, restart its position timer if it was released */
+static void idle_wake(CustomData *data)
+{
+	data->idle.since = g_get_monotonic_time();
+	data->idle.released = FALSE;
+
+	if (!data->idle.position_id)
+		data->idle.position_id = g_timeout_add_seconds(1,
+				(GSourceFunc) position_event, data);
+}
+
+static int media_uri_load(CustomData *data, struct playlist_item *item, int state)
+{
+	if (!item || !item->media_path)
+	{
+		AFB_ERROR("Failed to set media URI: no item provided!");
+		return -ENOENT;
+	}
+
+	fade_cancel(data);
+	start_cancel(data);
+	idle_wake(data);
+	gst_element_set_state(data->playbin, GST_STATE_NULL);
+	AFB_DEBUG("GSTREAMER playbin.state = GST_STATE_NULL");
+
+	g_object_set(data->playbin, "uri", playlist_item_uri(item), NULL);
+	AFB_DEBUG("GSTREAMER playbin.uri = %s", playlist_item_uri(item));
+	segment_set(data, item);
+	seek_index_reset(data, playlist_item_uri(item));
+
+	loudness_setup(data, g_hash_table_lookup(playlist_paths, item->media_path));
+	fader_set(data->playbin, data->fader_cs, (double) data->volume / 100.0);
+
+	position_set(data, -1, NULL, 1.0);
+	data->duration = GST_CLOCK_TIME_NONE;
+	data->rate = 1.0;
+	data->buffering = 100;
+
+	if (state) {
+		g_object_set(data->playbin, "audio-sink", data->audio_sink, NULL);
+		AFB_DEBUG("GSTREAMER playbin.audio-sink = pipewire-sink");
+
+		if (!data->playing)
+			mediaplayer_set_role_state(data, GST_STATE_PLAYING);
+		else
+			gst_element_set_state(data->playbin, GST_STATE_PLAYING);
+
+		AFB_DEBUG("GSTREAMER playbin.state = GST_STATE_PLAYING");
+	} else {
+		g_object_set(data->playbin, "audio-sink", data->fake_sink, NULL);
+		AFB_DEBUG("GSTREAMER playbin.audio-sink = fake-sink");
+
+#ifdef WIREPLUMBER_WORKAROUND
+		gst_element_set_state(data->playbin, GST_STATE_READY);
+		AFB_DEBUG("GSTREAMER playbin.state = GST_STATE_READY");
+#else
+		gst_element_set_state(data->playbin, GST_STATE_PAUSED);
+		AFB_DEBUG("GSTREAMER playbin.state = GST_STATE_PAUSED");
+#endif
+	}
+	// We can't be corked at this point
+	data->corked = FALSE;
+
+	return 0;
+}
+
+/*
+ * Load @item positioned at @position milliseconds, and play it if @state.
+ * The pipeline prerolls paused, seeks once prerolled and only then starts
+ * playing, see the ASYNC_DONE handling, so that nothing is heard from the
+ * start of the track. Chapters always start that way, from their offset.
+ */
+static int set_media_uri_at(CustomData *data, struct playlist_item *item,
+			    int state, gint64 position)
+{
+	int ret;
+
+	if (position <= 0 && !(item && item->uri))
+		return media_uri_load(data, item, state);
+
+	ret = media_uri_load(data, item, FALSE);
+	if (ret < 0)
+		return ret;
+
+	if (state) {
+		g_object_set(data->playbin, "audio-sink", data->audio_sink, NULL);
+		AFB_DEBUG("GSTREAMER playbin.audio-sink = pipewire-sink");
+	}
+
+	data->start.position = MAX(position, 0);
+	data->start.playing = state;
+	position_set(data, data->segment.start + data->start.position * GST_MSECOND,
+		     NULL, 1.0);
+
+	gst_element_set_state(data->playbin, GST_STATE_PAUSED);
+	AFB_DEBUG("GSTREAMER playbin.state = GST_STATE_PAUSED");
+
+	return 0;
+}
+
+static int set_media_uri(CustomData *data, struct playlist_item *item, int state)
+{
+	return set_media_uri_at(data, item, state, 0);
+}
+
+
+/*
+ * Playlist link of the item following @track in @order, or preceding it
+ * unless @forward. Orders other than the playlist one only hold audio items,
+ * other media keeps following the playlist.
+ */
+static GList *playlist_step(int order, GList *track, gboolean forward)
+{
+	struct playlist_item *item = track->data;
+
+	if (order == LIBRARY_ORDER_INDEX || !item ||
+	    g_strcmp0(item->media_type, "audio"))
+		return forward ? track->next : track->prev;
+
+	item = library_step(library, order, item, forward);
+
+	return item ? g_hash_table_lookup(playlist_paths, item->media_path) : NULL;
+}
+
+/* playlist link of the first item in @order */
+static GList *playlist_start(int order)
+{
+	struct playlist_item *item;
+
+	if (order == LIBRARY_ORDER_INDEX)
+		return playlist;
+
+	item = library_first(library, order);
+
+	return item ? g_hash_table_lookup(playlist_paths, item->media_path) : NULL;
+}
+
+/* TRUE if @item is a file that failed to play in its current version */
+static gboolean playlist_item_bad(struct playlist_item *item)
+{
+	return bad_cache && media_cache_lookup(bad_cache, playlist_item_uri(item));
+}
+
+/* like playlist_step(), skipping over files known to fail */
+static GList *playlist_step_playable(int order, GList *track, gboolean forward)
+{
+	guint left = g_hash_table_size(playlist_paths);
+
+	do {
+		track = playlist_step(order, track, forward);
+	} while (track && track->data && playlist_item_bad(track->data) && left--);
+
+	return track;
+}
+
+/* media path of chapter @n, from 1, of the file @uri */
+static gchar *playlist_chapter_path(const char *uri, int n)
+{
+	return g_strdup_printf("%s#chapter=%d", uri, n);
+}
+
+/* TRUE if @path is in the playlist, either whole or split into chapters */
+static gboolean playlist_contains(const char *path)
+{
+	gchar *chapter;
+	gboolean ret;
+
+	if (g_hash_table_contains(playlist_paths, path))
+		return TRUE;
+
+	chapter = playlist_chapter_path(path, 1);
+	ret = g_hash_table_contains(playlist_paths, chapter);
+	g_free(chapter);
+
+	return ret;
+}
+
+/* entry for chapter @n of @parent, falling back to the tags of the file */
+static struct playlist_item *playlist_chapter_new(struct playlist_item *parent,
+						  struct media_chapter *chapter,
+						  int n)
+{
+	struct playlist_item *item = g_malloc0(sizeof(*item));
+
+	item->media_path = playlist_chapter_path(parent->media_path, n);
+	item->media_type = g_strdup(parent->media_type);
+	item->uri = g_strdup(parent->media_path);
+	item->start = chapter->start;
+	item->end = chapter->end;
+
+	if (chapter->title)
+		item->title = g_strdup(chapter->title);
+	else
+		item->title = g_strdup_printf("Chapter %d", n);
+
+	item->artist = g_strdup(chapter->artist ? chapter->artist : parent->artist);
+	item->album = g_strdup(chapter->album ? chapter->album :
+			       parent->album ? parent->album : parent->title);
+	item->genre = g_strdup(parent->genre);
+
+	if (item->end > 0)
+		item->duration = item->end - item->start;
+	else if (parent->duration > item->start)
+		item->duration = parent->duration - item->start;
+
+	return item;
+}
+
+/* insert @item before @sibling, at the end if NULL */
+static void playlist_insert(struct playlist_item *item, GList *sibling)
+{
+	GList *link;
+
+	item->id = playlist_next_id++;
+	item->revision = ++playlist_revision;
+
+	if (sibling) {
+		playlist = g_list_insert_before(playlist, sibling, item);
+		link = sibling->prev;
+	} else {
+		link = g_list_alloc();
+		link->data = item;
+		link->prev = playlist_tail;
+		link->next = NULL;
+
+		if (playlist_tail)
+			playlist_tail->next = link;
+		else
+			playlist = link;
+		playlist_tail = link;
+	}
+
+	g_hash_table_insert(playlist_paths, item->media_path, link);
+
+	if (!g_strcmp0(item->media_type, "audio"))
+		library_add(library, item);
+}
+
+/* remove @link from playlist, its item is left to the caller */
+static void playlist_unlink(GList *link)
+{
+	if (link == playlist_tail)
+		playlist_tail = link->prev;
+
+	playlist = g_list_delete_link(playlist, link);
+}
+
+static void playlist_insert_chapters(struct playlist_item *parent,
+				     GPtrArray *chapters, GList *sibling)
+{
+	int i;
+
+	for (i = 0; i < chapters->len; i++)
+		playlist_insert(playlist_chapter_new(parent, chapters->pdata[i],
+						     i + 1), sibling);
+}
+
+static void populate_playlist(json_object *jquery)
+{
+	int i, z;
+
+	for (i = 0; i < json_object_array_length(jquery); i++) {
+		json_object *jdict = json_object_array_get_idx(jquery, i);
+		struct playlist_item *item = g_malloc0(sizeof(*item));
 		int ret;
 
-		if (item == NULL)
-			break;
+		if (item == NULL)
+			break;
+
+		ret = populate_from_json(item, jdict);
+		if (!ret || playlist_contains(item->media_path)) {
+			g_free_playlist_item(item);
+			continue;
+		}
+
+		playlist_insert(item, NULL);
+
+		// fills in the tags and duration, and splits single file albums
+		// and audiobooks into their chapters
+		discovery_queue(item);
+	}
+
+	for (z = 0; z < num_zones; z++) {
+		CustomData *data = &zones[z];
+
+		if (data->current_track)
+			continue;
+
+		data->current_track = playlist_start(data->order);
+		if (data->current_track && data->current_track->data)
+			set_media_uri(data, data->current_track->data, FALSE);
+	}
+}
+
+/*
+ * Replace the entry of @link by its @chapters, unless a zone already started
+ * playing it. Zones just loaded on it move to its first chapter. Must be
+ * called with mutex held.
+ */
+static gboolean playlist_expand(GList *link, GPtrArray *chapters)
+{
+	struct playlist_item *item = link->data;
+	GList *first;
+	int z;
+
+	for (z = 0; z < num_zones; z++) {
+		if (zones[z].current_track == link &&
+		    (zones[z].playing || position_get(&zones[z]) > 0))
+			return FALSE;
+	}
+
+	playlist_insert_chapters(item, chapters, link->next);
+	first = link->next;
+
+	for (z = 0; z < num_zones; z++) {
+		if (zones[z].current_track != link)
+			continue;
+
+		zones[z].current_track = first;
+		set_media_uri(&zones[z], first->data, FALSE);
+	}
+
+	g_hash_table_remove(playlist_paths, item->media_path);
+	library_remove(library, item);
+	playlist_unlink(link);
+	g_free_playlist_item(item);
+
+	return TRUE;
+}
+
+static json_object *populate_json_playlist(CustomData *data, json_object *jresp,
+					   int order)
+{
+	GList *l;
+	json_object *jarray = json_object_new_array();
+
+	for (l = playlist_start(order); l; l = playlist_step(order, l, TRUE)) {
+		struct playlist_item *track = l->data;
+
+		if (track && !g_strcmp0(track->media_type, "audio")) {
+			json_object *item = populate_json(data, track);
+			json_object_array_add(jarray, item);
+		}
+	}
+
+	json_object_object_add(jresp, "list", jarray);
+
+	return jresp;
+}
+
+static int compact_string_idx(GHashTable *dict, json_object *jstrings,
+			      const char *str)
+{
+	gpointer idx;
+
+	if (!str)
+		return -1;
+
+	if (g_hash_table_lookup_extended(dict, str, NULL, &idx))
+		return GPOINTER_TO_INT(idx);
+
+	idx = GINT_TO_POINTER(json_object_array_length(jstrings));
+	json_object_array_add(jstrings, json_object_new_string(str));
+	g_hash_table_insert(dict, (gpointer) str, idx);
+
+	return GPOINTER_TO_INT(idx);
+}
+
+/*
+ * Compact playlist encoding: one array per field instead of one object per
+ * entry, with album, artist and genre given as indexes into a shared string
+ * table (-1 when unknown). Missing titles are null, unknown durations 0.
+ */
+static json_object *populate_json_playlist_compact(CustomData *data, json_object *jresp,
+						   int order)
+{
+	GHashTable *dict = g_hash_table_new(g_str_hash, g_str_equal);
+	json_object *jstrings = json_object_new_array();
+	json_object *jindex = json_object_new_array();
+	json_object *jpath = json_object_new_array();
+	json_object *jtitle = json_object_new_array();
+	json_object *jalbum = json_object_new_array();
+	json_object *jartist = json_object_new_array();
+	json_object *jgenre = json_object_new_array();
+	json_object *jduration = json_object_new_array();
+	json_object *jcolumns = json_object_new_object();
+	int selected = -1, count = 0;
+	GList *l;
+
+	for (l = playlist_start(order); l; l = playlist_step(order, l, TRUE)) {
+		struct playlist_item *track = l->data;
+
+		if (!track || g_strcmp0(track->media_type, "audio"))
+			continue;
+
+		if (data->current_track && track == data->current_track->data)
+			selected = track->id;
+
+		json_object_array_add(jindex, json_object_new_int(track->id));
+		json_object_array_add(jpath, json_object_new_string(track->media_path));
+		json_object_array_add(jtitle, track->title ?
+				      json_object_new_string(track->title) : NULL);
+		json_object_array_add(jalbum, json_object_new_int(
+				compact_string_idx(dict, jstrings, track->album)));
+		json_object_array_add(jartist, json_object_new_int(
+				compact_string_idx(dict, jstrings, track->artist)));
+		json_object_array_add(jgenre, json_object_new_int(
+				compact_string_idx(dict, jstrings, track->genre)));
+		json_object_array_add(jduration, json_object_new_int64(
+				MAX(track->duration, 0)));
+		count++;
+	}
+
+	g_hash_table_destroy(dict);
+
+	json_object_object_add(jcolumns, "index", jindex);
+	json_object_object_add(jcolumns, "path", jpath);
+	json_object_object_add(jcolumns, "title", jtitle);
+	json_object_object_add(jcolumns, "album", jalbum);
+	json_object_object_add(jcolumns, "artist", jartist);
+	json_object_object_add(jcolumns, "genre", jgenre);
+	json_object_object_add(jcolumns, "duration", jduration);
+
+	json_object_object_add(jresp, "format",
+			       json_object_new_string(PLAYLIST_FORMATS[PLAYLIST_FORMAT_COMPACT]));
+	json_object_object_add(jresp, "count", json_object_new_int(count));
+	json_object_object_add(jresp, "selected", json_object_new_int(selected));
+	json_object_object_add(jresp, "strings", jstrings);
+	json_object_object_add(jresp, "columns", jcolumns);
+
+	return jresp;
+}
+
+/* push the playlist to subscribers of both encodings, in every zone */
+static void playlist_push(void)
+{
+	json_object *jresp[ZONES_MAX], *jcompact[ZONES_MAX] = { NULL };
+	guint subscribes[ZONES_MAX];
+	int z;
+
+	g_mutex_lock(&mutex);
+
+	for (z = 0; z < num_zones; z++) {
+		CustomData *data = &zones[z];
+
+		jresp[z] = populate_json_playlist(data, json_object_new_object(),
+						  data->order);
+		if (data->playlist_compact_listeners)
+			jcompact[z] = populate_json_playlist_compact(data,
+						json_object_new_object(), data->order);
+		subscribes[z] = data->playlist_compact_subscribes;
+	}
+
+	g_mutex_unlock(&mutex);
+
+	for (z = 0; z < num_zones; z++) {
+		CustomData *data = &zones[z];
+
+		afb_event_push(data->playlist_event, jresp[z]);
+
+		if (jcompact[z] &&
+		    afb_event_push(data->playlist_compact_event, jcompact[z]) == 0) {
+			g_mutex_lock(&mutex);
+
+			// unless someone subscribed since the payload was built
+			if (data->playlist_compact_subscribes == subscribes[z])
+				data->playlist_compact_listeners = FALSE;
+
+			g_mutex_unlock(&mutex);
+		}
+	}
+}
+
+#define DISCOVERY_TIMEOUT	(10 * GST_SECOND)
+#define DISCOVERY_BATCH_MS	1000
+#define DISCOVERY_CHECK_BATCH	64	/* files checked per idle run */
+#define DISCOVERY_SAVE_SECONDS	30
+#define DISCOVERY_CACHE		"discovery"
+
+/*
+ * Background discovery fills in the duration and tags mediascanner didn't
+ * provide, and splits single file albums and audiobooks into chapters.
+ * Queued files are checked in batches from a low priority idle, which stamps
+ * them and looks for their CUE sheet without holding mutex, then applies
+ * what the cache holds for them. Files still lacking data go to a bounded
+ * pool of discoverers working one URI at a time each. Playlist updates are
+ * batched, the cache is saved once changed at most every
+ * DISCOVERY_SAVE_SECONDS, and files gone or changed since it was loaded are
+ * dropped from it. All state is protected by mutex.
+ */
+struct discovery_worker {
+	GstDiscoverer *discoverer;
+	gchar *uri;
+};
+
+static struct {
+	struct discovery_worker workers[DISCOVERY_MAX_WORKERS];
+	GQueue pending;		/* URIs to check */
+	GQueue discover;	/* URIs checked, to discover */
+	GHashTable *queued;	/* URIs queued or being discovered */
+	GKeyFile *cache;
+	gchar **prune;		/* URIs cached at load, NULL once checked */
+	gsize prune_next;
+	guint dispatch_id;
+	guint flush_id;
+	guint save_id;
+	gboolean updated;
+} discovery;
+
+static gboolean discovery_needed(struct playlist_item *item)
+{
+	return item->duration <= 0 || !item->title || !item->album ||
+	       !item->artist || !item->genre;
+}
+
+static gboolean discovery_wants_chapters(struct playlist_item *item)
+{
+	return !item->uri && !g_strcmp0(item->media_type, "audio");
+}
+
+static gboolean discovery_save(gpointer user_data)
+{
+	gchar *contents;
+	gsize length = 0;
+
+	g_mutex_lock(&mutex);
+	discovery.save_id = 0;
+	contents = g_key_file_to_data(discovery.cache, &length, NULL);
+	g_mutex_unlock(&mutex);
+
+	if (!media_cache_write(DISCOVERY_CACHE, contents, length))
+		AFB_WARNING("Cannot save discovery cache");
+
+	g_free(contents);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* the cache changed, save it a while later. Must be called with mutex held */
+static void discovery_changed(void)
+{
+	if (!discovery.save_id)
+		discovery.save_id = g_timeout_add_seconds_full(G_PRIORITY_LOW,
+				DISCOVERY_SAVE_SECONDS, discovery_save, NULL, NULL);
+}
+
+static gboolean discovery_apply_tag(gchar **field, const char *uri,
+				    const char *key)
+{
+	if (*field)
+		return FALSE;
+
+	*field = g_key_file_get_string(discovery.cache, uri, key, NULL);
+
+	return *field != NULL;
+}
+
+/* fill in what @item is missing from the cache, mediascanner data wins */
+static gboolean discovery_apply(struct playlist_item *item)
+{
+	const char *uri = item->media_path;
+	gboolean changed = FALSE;
+
+	if (item->duration <= 0) {
+		gint64 duration = g_key_file_get_int64(discovery.cache, uri,
+						       "duration", NULL);
+
+		if (duration > 0) {
+			item->duration = duration;
+			changed = TRUE;
+		}
+	}
+
+	changed |= discovery_apply_tag(&item->title, uri, "title");
+	changed |= discovery_apply_tag(&item->album, uri, "album");
+	changed |= discovery_apply_tag(&item->artist, uri, "artist");
+	changed |= discovery_apply_tag(&item->genre, uri, "genre");
+
+	if (changed) {
+		item->revision = ++playlist_revision;
+		library_update(library, item);
+	}
+
+	return changed;
+}
+
+static void discovery_forget(gchar *uri)
+{
+	g_hash_table_remove(discovery.queued, uri);
+	g_free(uri);
+}
+
+/*
+ * Apply what the cache holds for @uri, checked with its @stamp and the
+ * chapters of its @cue sheet, queueing it for discovery if still needed.
+ * Takes @uri and @cue. Must be called with mutex held.
+ */
+static void discovery_checked(gchar *uri, const char *stamp, GPtrArray *cue)
+{
+	GList *l = g_hash_table_lookup(playlist_paths, uri);
+	GPtrArray *chapters = cue;
+	gboolean cached;
+
+	if (!l || !stamp) {
+		if (chapters)
+			g_ptr_array_free(chapters, TRUE);
+		discovery_forget(uri);
+		return;
+	}
+
+	cached = media_cache_match(discovery.cache, uri, stamp);
+	if (cached && discovery_apply(l->data))
+		discovery.updated = TRUE;
+
+	// CUE sheets win over the chapters of the container
+	if (!chapters && cached && discovery_wants_chapters(l->data))
+		chapters = discovery_chapters(uri);
+
+	if (chapters) {
+		gboolean expanded = playlist_expand(l, chapters);
+
+		g_ptr_array_free(chapters, TRUE);
+		if (expanded) {
+			discovery.updated = TRUE;
+			discovery_forget(uri);
+			return;
+		}
+	}
+
+	if (!cached && settings.discovery_workers && discovery_needed(l->data)) {
+		g_queue_push_tail(&discovery.discover, uri);
+		return;
+	}
+
+	discovery_forget(uri);
+}
+
+static gboolean discovery_dispatch(gpointer user_data)
+{
+	gchar *uris[DISCOVERY_CHECK_BATCH], *stamps[DISCOVERY_CHECK_BATCH];
+	GPtrArray *cues[DISCOVERY_CHECK_BATCH];
+	gboolean chapters[DISCOVERY_CHECK_BATCH];
+	gboolean prune = FALSE;
+	int i, n = 0;
+
+	g_mutex_lock(&mutex);
+
+	while (n < DISCOVERY_CHECK_BATCH &&
+	       (uris[n] = g_queue_pop_head(&discovery.pending))) {
+		GList *l = g_hash_table_lookup(playlist_paths, uris[n]);
+
+		chapters[n++] = l && discovery_wants_chapters(l->data);
+	}
+
+	// the files cached at load are checked once the queued ones are
+	if (!n && discovery.prune) {
+		prune = TRUE;
+		while (n < DISCOVERY_CHECK_BATCH &&
+		       discovery.prune[discovery.prune_next]) {
+			uris[n] = discovery.prune[discovery.prune_next++];
+			chapters[n++] = FALSE;
+		}
+	}
+
+	g_mutex_unlock(&mutex);
+
+	// the file system is accessed without holding mutex
+	for (i = 0; i < n; i++) {
+		stamps[i] = media_file_stamp(uris[i]);
+		cues[i] = stamps[i] && chapters[i] ?
+			  media_chapters_from_cue(uris[i]) : NULL;
+	}
+
+	g_mutex_lock(&mutex);
+
+	for (i = 0; i < n; i++) {
+		if (!prune)
+			discovery_checked(uris[i], stamps[i], cues[i]);
+		else if (g_key_file_has_group(discovery.cache, uris[i]) &&
+			 !media_cache_match(discovery.cache, uris[i], stamps[i]))
+			discovery_changed();
+
+		g_free(stamps[i]);
+	}
+
+	if (prune && !discovery.prune[discovery.prune_next]) {
+		g_strfreev(discovery.prune);
+		discovery.prune = NULL;
+	}
+
+	for (i = 0; i < settings.discovery_workers; i++) {
+		struct discovery_worker *worker = &discovery.workers[i];
+		gchar *uri;
+
+		while (!worker->uri && (uri = g_queue_pop_head(&discovery.discover))) {
+			if (gst_discoverer_discover_uri_async(worker->discoverer, uri))
+				worker->uri = uri;
+			else
+				discovery_forget(uri);
+		}
+	}
+
+	if (discovery.updated && !discovery.flush_id)
+		discovery.flush_id = g_timeout_add(DISCOVERY_BATCH_MS,
+				discovery_flush, NULL);
+
+	if (!g_queue_is_empty(&discovery.pending) || discovery.prune) {
+		g_mutex_unlock(&mutex);
+		return G_SOURCE_CONTINUE;
+	}
+
+	discovery.dispatch_id = 0;
+	g_mutex_unlock(&mutex);
+
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean discovery_flush(gpointer user_data)
+{
+	gboolean updated;
+
+	g_mutex_lock(&mutex);
+
+	discovery.flush_id = 0;
+	updated = discovery.updated;
+	discovery.updated = FALSE;
+
+	g_mutex_unlock(&mutex);
+
+	if (updated)
+		playlist_push();
+
+	return G_SOURCE_REMOVE;
+}
+
+static void discovery_store_tag(const GstTagList *tags, const char *uri,
+				const char *tag, const char *key)
+{
+	gchar *value = NULL;
+
+	if (!gst_tag_list_get_string(tags, tag, &value))
+		return;
+
+	g_key_file_set_string(discovery.cache, uri, key, value);
+	g_free(value);
+}
+
+/* chapter times and titles of the container, Matroska nests them in editions */
+static void discovery_store_chapters(GstToc *toc, const char *uri)
+{
+	GArray *starts = g_array_new(FALSE, FALSE, sizeof(gint));
+	GArray *ends = g_array_new(FALSE, FALSE, sizeof(gint));
+	GPtrArray *titles = g_ptr_array_new_with_free_func(g_free);
+	GList *entries = gst_toc_get_entries(toc), *l;
+
+	if (entries && gst_toc_entry_get_entry_type(entries->data) ==
+			GST_TOC_ENTRY_TYPE_EDITION)
+		entries = gst_toc_entry_get_sub_entries(entries->data);
+
+	for (l = entries; l; l = l->next) {
+		GstTocEntry *entry = l->data;
+		GstTagList *tags = gst_toc_entry_get_tags(entry);
+		gint64 start, stop;
+		gchar *title = NULL;
+		gint value;
+
+		if (gst_toc_entry_get_entry_type(entry) != GST_TOC_ENTRY_TYPE_CHAPTER ||
+		    !gst_toc_entry_get_start_stop_times(entry, &start, &stop))
+			continue;
+
+		value = start / GST_MSECOND;
+		g_array_append_val(starts, value);
+		value = stop >= 0 ? stop / GST_MSECOND : 0;
+		g_array_append_val(ends, value);
+
+		if (!tags || !gst_tag_list_get_string(tags, GST_TAG_TITLE, &title))
+			title = g_strdup("");
+		g_ptr_array_add(titles, title);
+	}
+
+	if (starts->len > 1) {
+		g_key_file_set_integer_list(discovery.cache, uri, "chapter-start",
+					    (gint *) starts->data, starts->len);
+		g_key_file_set_integer_list(discovery.cache, uri, "chapter-end",
+					    (gint *) ends->data, ends->len);
+		g_key_file_set_string_list(discovery.cache, uri, "chapter-title",
+					   (const gchar * const *) titles->pdata,
+					   titles->len);
+	}
+
+	g_ptr_array_free(titles, TRUE);
+	g_array_free(ends, TRUE);
+	g_array_free(starts, TRUE);
+}
+
+/*
+ * Chapters of @uri found by discovery, NULL without at least two of them.
+ * The cached values of @uri must be current.
+ */
+static GPtrArray *discovery_chapters(const char *uri)
+{
+	GPtrArray *chapters = NULL;
+	gsize i, num_starts = 0, num_ends = 0, num_titles = 0;
+	gchar **titles;
+	gint *starts, *ends;
+
+	starts = g_key_file_get_integer_list(discovery.cache, uri, "chapter-start",
+					     &num_starts, NULL);
+	ends = g_key_file_get_integer_list(discovery.cache, uri, "chapter-end",
+					   &num_ends, NULL);
+	titles = g_key_file_get_string_list(discovery.cache, uri, "chapter-title",
+					    &num_titles, NULL);
+
+	if (starts && ends && num_starts > 1 && num_ends == num_starts) {
+		chapters = g_ptr_array_new_with_free_func(media_chapter_free);
+
+		for (i = 0; i < num_starts; i++) {
+			struct media_chapter *chapter = g_new0(struct media_chapter, 1);
+
+			chapter->start = starts[i];
+			chapter->end = ends[i];
+			if (i < num_titles && *titles[i])
+				chapter->title = g_strdup(titles[i]);
+
+			g_ptr_array_add(chapters, chapter);
+		}
+	}
+
+	g_strfreev(titles);
+	g_free(ends);
+	g_free(starts);
+
+	return chapters;
+}
+
+static void discovered(GstDiscoverer *discoverer, GstDiscovererInfo *info,
+		       GError *error, struct discovery_worker *worker)
+{
+	const char *uri = gst_discoverer_info_get_uri(info);
+	gchar *stamp = media_file_stamp(uri);
+
+	g_mutex_lock(&mutex);
+
+	if (gst_discoverer_info_get_result(info) == GST_DISCOVERER_OK && stamp) {
+		const GstTagList *tags = gst_discoverer_info_get_tags(info);
+		const GstToc *toc = gst_discoverer_info_get_toc(info);
+		GstClockTime duration = gst_discoverer_info_get_duration(info);
+		GPtrArray *chapters;
+		GList *l;
+
+		media_cache_set_stamp(discovery.cache, uri, stamp);
+		discovery_changed();
+
+		if (GST_CLOCK_TIME_IS_VALID(duration))
+			g_key_file_set_int64(discovery.cache, uri, "duration",
+					     duration / GST_MSECOND);
+
+		if (tags) {
+			discovery_store_tag(tags, uri, GST_TAG_TITLE, "title");
+			discovery_store_tag(tags, uri, GST_TAG_ALBUM, "album");
+			discovery_store_tag(tags, uri, GST_TAG_ARTIST, "artist");
+			discovery_store_tag(tags, uri, GST_TAG_GENRE, "genre");
+		}
+
+		if (toc)
+			discovery_store_chapters((GstToc *) toc, uri);
+
+		l = g_hash_table_lookup(playlist_paths, uri);
+		if (l && discovery_apply(l->data))
+			discovery.updated = TRUE;
+
+		chapters = l && discovery_wants_chapters(l->data) ?
+			   discovery_chapters(uri) : NULL;
+		if (chapters) {
+			if (playlist_expand(l, chapters))
+				discovery.updated = TRUE;
+			g_ptr_array_free(chapters, TRUE);
+		}
+	} else {
+		AFB_DEBUG("Cannot discover %s: %s", uri,
+			  error ? error->message : "unknown error");
+	}
+
+	if (worker->uri) {
+		discovery_forget(worker->uri);
+		worker->uri = NULL;
+	}
+
+	if (!g_queue_is_empty(&discovery.discover) && !discovery.dispatch_id)
+		discovery.dispatch_id = g_idle_add_full(G_PRIORITY_LOW,
+				discovery_dispatch, NULL, NULL);
+
+	if (!discovery.flush_id)
+		discovery.flush_id = g_timeout_add(DISCOVERY_BATCH_MS,
+				discovery_flush, NULL);
+
+	g_mutex_unlock(&mutex);
+
+	g_free(stamp);
+}
+
+/* queue @item to be checked, see discovery_dispatch(). Must be called with mutex held */
+static void discovery_queue(struct playlist_item *item)
+{
+	gchar *uri;
+
+	// only local files are stamped, chapters have the one of their file
+	if (!discovery.cache || item->uri ||
+	    !g_str_has_prefix(item->media_path, "file://") ||
+	    (!discovery_needed(item) && !discovery_wants_chapters(item)) ||
+	    g_hash_table_contains(discovery.queued, item->media_path))
+		return;
+
+	uri = g_strdup(item->media_path);
+	g_hash_table_add(discovery.queued, uri);
+	g_queue_push_tail(&discovery.pending, uri);
+
+	if (!discovery.dispatch_id)
+		discovery.dispatch_id = g_idle_add_full(G_PRIORITY_LOW,
+				discovery_dispatch, NULL, NULL);
+}
+
+static void discovery_init(void)
+{
+	int i;
+
+	discovery.cache = media_cache_load(DISCOVERY_CACHE);
+	discovery.queued = g_hash_table_new(g_str_hash, g_str_equal);
+
+	// drop the files gone or changed since they were cached
+	discovery.prune = g_key_file_get_groups(discovery.cache, NULL);
+	if (discovery.prune && discovery.prune[0])
+		discovery.dispatch_id = g_idle_add_full(G_PRIORITY_LOW,
+				discovery_dispatch, NULL, NULL);
+	else
+		g_clear_pointer(&discovery.prune, g_strfreev);
+
+	for (i = 0; i < settings.discovery_workers; i++) {
+		GError *error = NULL;
+		GstDiscoverer *discoverer;
+
+		discoverer = gst_discoverer_new(DISCOVERY_TIMEOUT, &error);
+		if (!discoverer) {
+			AFB_WARNING("Cannot create discoverer: %s", error->message);
+			g_error_free(error);
+			break;
+		}
+
+		g_signal_connect(discoverer, "discovered",
+				 G_CALLBACK(discovered), &discovery.workers[i]);
+		gst_discoverer_start(discoverer);
+
+		discovery.workers[i].discoverer = discoverer;
+	}
+
+	settings.discovery_workers = i;
+}
+
+#define LOUDNESS_CACHE		"loudness"
+#define LOUDNESS_SAVE_SECONDS	10
+
+/*
+ * Loudness normalization runs the stream through rgvolume, which applies
+ * the ReplayGain tags of the stream when present. Files without tags are
+ * analyzed once in the background and their gain cached, to be applied as
+ * the rgvolume fallback gain on the next plays. Gains are kept aside until
+ * a low priority timer stamps their files and saves the cache, see
+ * loudness_save(). All state is protected by mutex.
+ */
+static struct {
+	GstElement *pipeline;
+	gchar *uri;
+	gdouble gain;
+	gboolean have_gain;
+	GQueue pending;
+	GKeyFile *cache;
+	GHashTable *unsaved;	/* URI -> gain not in the cache yet */
+	guint dispatch_id;
+	guint save_id;
+} loudness;
+
+/*
+ * TRUE if the gain of @uri is known, returned in @gain. Must be called with
+ * mutex held.
+ */
+static gboolean loudness_lookup(const char *uri, gdouble *gain)
+{
+	gdouble *unsaved = g_hash_table_lookup(loudness.unsaved, uri);
+
+	if (unsaved) {
+		*gain = *unsaved;
+		return TRUE;
+	}
+
+	if (!media_cache_lookup(loudness.cache, uri))
+		return FALSE;
+
+	*gain = g_key_file_get_double(loudness.cache, uri, "gain", NULL);
+
+	return TRUE;
+}
+
+/* cache the unsaved gains and save the cache, the files being stamped off the mutex */
+static gboolean loudness_save(gpointer user_data)
+{
+	GPtrArray *uris = g_ptr_array_new_with_free_func(g_free);
+	GPtrArray *stamps = g_ptr_array_new_with_free_func(g_free);
+	GHashTableIter iter;
+	gpointer key;
+	gchar *contents;
+	gsize length = 0;
+	guint i;
+
+	g_mutex_lock(&mutex);
+	loudness.save_id = 0;
+	g_hash_table_iter_init(&iter, loudness.unsaved);
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+		g_ptr_array_add(uris, g_strdup(key));
+	g_mutex_unlock(&mutex);
+
+	for (i = 0; i < uris->len; i++)
+		g_ptr_array_add(stamps, media_file_stamp(uris->pdata[i]));
+
+	g_mutex_lock(&mutex);
+
+	for (i = 0; i < uris->len; i++) {
+		const char *uri = uris->pdata[i];
+		gdouble *gain = g_hash_table_lookup(loudness.unsaved, uri);
+
+		// gone files are not cached, their gain being of no use
+		if (gain && stamps->pdata[i]) {
+			media_cache_set_stamp(loudness.cache, uri, stamps->pdata[i]);
+			g_key_file_set_double(loudness.cache, uri, "gain", *gain);
+		}
+		g_hash_table_remove(loudness.unsaved, uri);
+	}
+
+	contents = g_key_file_to_data(loudness.cache, &length, NULL);
+
+	g_mutex_unlock(&mutex);
+
+	if (!media_cache_write(LOUDNESS_CACHE, contents, length))
+		AFB_WARNING("Cannot save loudness cache");
+
+	g_free(contents);
+	g_ptr_array_free(stamps, TRUE);
+	g_ptr_array_free(uris, TRUE);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Must be called with mutex held */
+static void loudness_store(const char *uri, gdouble gain)
+{
+	gdouble *value = g_new(gdouble, 1);
+
+	*value = gain;
+	g_hash_table_insert(loudness.unsaved, g_strdup(uri), value);
+
+	if (!loudness.save_id)
+		loudness.save_id = g_timeout_add_seconds_full(G_PRIORITY_LOW,
+				LOUDNESS_SAVE_SECONDS, loudness_save, NULL, NULL);
+}
+
+static gboolean loudness_dispatch(gpointer user_data);
+
+static void loudness_done(void)
+{
+	GstBus *bus = gst_element_get_bus(loudness.pipeline);
+
+	gst_bus_remove_watch(bus);
+	gst_object_unref(bus);
+
+	gst_element_set_state(loudness.pipeline, GST_STATE_NULL);
+	gst_object_unref(loudness.pipeline);
+	loudness.pipeline = NULL;
+
+	g_free(loudness.uri);
+	loudness.uri = NULL;
+
+	if (!g_queue_is_empty(&loudness.pending) && !loudness.dispatch_id)
+		loudness.dispatch_id = g_idle_add_full(G_PRIORITY_LOW,
+				loudness_dispatch, NULL, NULL);
+}
+
+static gboolean loudness_message(GstBus *bus, GstMessage *msg, gpointer user_data)
+{
+	g_mutex_lock(&mutex);
+
+	switch (GST_MESSAGE_TYPE(msg)) {
+	case GST_MESSAGE_TAG: {
+		GstTagList *tags = NULL;
+
+		gst_message_parse_tag(msg, &tags);
+		if (!tags)
+			break;
+
+		if (gst_tag_list_get_double(tags, GST_TAG_TRACK_GAIN, &loudness.gain))
+			loudness.have_gain = TRUE;
+
+		gst_tag_list_unref(tags);
+		break;
+	}
+	case GST_MESSAGE_EOS:
+		if (loudness.have_gain) {
+			AFB_DEBUG("Loudness of %s: %f dB", loudness.uri, loudness.gain);
+			loudness_store(loudness.uri, loudness.gain);
+		}
+		loudness_done();
+		break;
+	case GST_MESSAGE_ERROR:
+		AFB_DEBUG("Cannot analyze loudness of %s", loudness.uri);
+		loudness_done();
+		break;
+	default:
+		break;
+	}
+
+	g_mutex_unlock(&mutex);
+
+	return TRUE;
+}
+
+static gboolean loudness_dispatch(gpointer user_data)
+{
+	gdouble gain;
+	gchar *uri;
+
+	g_mutex_lock(&mutex);
+
+	loudness.dispatch_id = 0;
+
+	while (!loudness.pipeline && (uri = g_queue_pop_head(&loudness.pending))) {
+		GstElement *src;
+		GstBus *bus;
+
+		// may have been analyzed, or found in tags, since it was queued
+		if (loudness_lookup(uri, &gain)) {
+			g_free(uri);
+			continue;
+		}
+
+		loudness.pipeline = gst_parse_launch("uridecodebin name=src ! "
+				"audioconvert ! audioresample ! rganalysis ! "
+				"fakesink sync=false", NULL);
+		if (!loudness.pipeline) {
+			AFB_WARNING("Cannot create loudness analysis pipeline");
+			g_free(uri);
+			break;
+		}
+
+		src = gst_bin_get_by_name(GST_BIN(loudness.pipeline), "src");
+		g_object_set(src, "uri", uri, NULL);
+		gst_object_unref(src);
+
+		bus = gst_element_get_bus(loudness.pipeline);
+		gst_bus_add_watch(bus, loudness_message, NULL);
+		gst_object_unref(bus);
+
+		loudness.uri = uri;
+		loudness.have_gain = FALSE;
+
+		gst_element_set_state(loudness.pipeline, GST_STATE_PLAYING);
+	}
+
+	g_mutex_unlock(&mutex);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void loudness_queue(const char *uri)
+{
+	if (!g_str_has_prefix(uri, "file://") ||
+	    !g_strcmp0(loudness.uri, uri) ||
+	    g_queue_find_custom(&loudness.pending, uri, (GCompareFunc) g_strcmp0))
+		return;
+
+	g_queue_push_tail(&loudness.pending, g_strdup(uri));
+
+	if (!loudness.dispatch_id)
+		loudness.dispatch_id = g_idle_add_full(G_PRIORITY_LOW,
+				loudness_dispatch, NULL, NULL);
+}
+
+/*
+ * Set up normalization for the playlist entry @track about to be played,
+ * and get the following one analyzed ahead of time. Must be called with
+ * mutex held and the pipeline stopped.
+ */
+static void loudness_setup(CustomData *data, GList *track)
+{
+	struct playlist_item *item;
+	gdouble gain = 0.0;
+
+	if (!data->rgvolume)
+		return;
+
+	audio_filter_normalize(data, data->normalize);
+
+	if (!data->normalize || !track)
+		return;
+
+	item = track->data;
+	if (!loudness_lookup(playlist_item_uri(item), &gain))
+		loudness_queue(playlist_item_uri(item));
+
+	g_object_set(data->rgvolume, "fallback-gain", gain, NULL);
+	AFB_DEBUG("GSTREAMER rgvolume.fallback-gain = %f", gain);
+
+	if (track->next) {
+		item = track->next->data;
+		if (!loudness_lookup(playlist_item_uri(item), &gain))
+			loudness_queue(playlist_item_uri(item));
+	}
+}
+
+static void loudness_init(void)
+{
+	loudness.cache = media_cache_load(LOUDNESS_CACHE);
+	loudness.unsaved = g_hash_table_new_full(g_str_hash, g_str_equal,
+						 g_free, g_free);
+}
+
+static void audio_playlist(afb_req_t request)
+{
+	const char *value = afb_req_value(request, "list");
+	int format = find_playlist_format_idx(afb_req_value(request, "format"));
+	CustomData *data = zone_find(afb_req_value(request, "zone"));
+	json_object *jresp = NULL;
+	int order;
+
+	if (format < 0) {
+		afb_req_fail(request, "failed", "invalid format");
+		return;
+	}
+
+	if (!data) {
+		afb_req_fail(request, "failed", "invalid zone");
+		return;
+	}
+
+	order = find_playlist_order_idx(afb_req_value(request, "sort"), data->order);
+	if (order < 0) {
+		afb_req_fail(request, "failed", "invalid sort");
+		return;
+	}
+
+	g_mutex_lock(&mutex);
+
+	if (value) {
+		json_object *jquery;
+		int z;
+
+		if (playlist) {
+			g_hash_table_remove_all(playlist_paths);
+			library_clear(library);
+			g_list_free_full(playlist, g_free_playlist_item);
+			playlist = NULL;
+			playlist_tail = NULL;
+			playlist_next_id = 0;
+
+			for (z = 0; z < num_zones; z++)
+				zones[z].current_track = NULL;
+		}
+
+		jquery = json_tokener_parse(value);
+		populate_playlist(jquery);
+
+		if (playlist == NULL)
+			afb_req_fail(request, "failed", "invalid playlist");
+		else
+			afb_req_success(request, NULL, NULL);
+
+		for (z = 0; z < num_zones; z++)
+			state_publish(&zones[z]);
+
+		json_object_put(jquery);
+	} else {
+		jresp = json_object_new_object();
+		if (format == PLAYLIST_FORMAT_COMPACT)
+			jresp = populate_json_playlist_compact(data, jresp, order);
+		else
+			jresp = populate_json_playlist(data, jresp, order);
+
+		afb_req_success(request, jresp, "Playlist results");
+	}
+
+	g_mutex_unlock(&mutex);
+}
+
+#define PAGE_LIMIT_DEFAULT	50
+
+static int find_library_idx(const char * const *names, int num, const char *name)
+{
+	int idx;
+
+	for (idx = 0; idx < num; idx++) {
+		if (!g_strcmp0(names[idx], name))
+			return idx;
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * Search the audio items of the playlist, see library_search(). Titles,
+ * artists and albums are matched case insensitively against @text, by
+ * substring unless @match is prefix, and @genre must match exactly.
+ */
+static void search(afb_req_t request)
+{
+	json_object *jargs = afb_req_json(request);
+	CustomData *data = zone_find(afb_req_value(request, "zone"));
+	struct library_query query = {
+		.text = afb_req_value(request, "text"),
+		.match = LIBRARY_MATCH_SUBSTRING,
+		.fields = LIBRARY_TEXT_FIELDS,
+		.genre = afb_req_value(request, "genre"),
+		.offset = 0,
+		.limit = PAGE_LIMIT_DEFAULT,
+	};
+	json_object *jresp, *jarray, *val = NULL;
+	GPtrArray *results;
+	int i, total;
+
+	if (!data) {
+		afb_req_fail(request, "failed", "invalid zone");
+		return;
+	}
+
+	if (json_object_object_get_ex(jargs, "match", &val)) {
+		query.match = find_library_idx(library_matches,
+					       LIBRARY_NUM_MATCHES,
+					       json_object_get_string(val));
+		if (query.match < 0) {
+			afb_req_fail(request, "failed", "invalid match");
+			return;
+		}
+	}
+
+	if (json_object_object_get_ex(jargs, "fields", &val)) {
+		if (!json_object_is_type(val, json_type_array)) {
+			afb_req_fail(request, "failed", "invalid fields");
+			return;
+		}
+
+		query.fields = 0;
+		for (i = 0; i < json_object_array_length(val); i++) {
+			json_object *jfield = json_object_array_get_idx(val, i);
+			int field = find_library_idx(library_fields,
+						     LIBRARY_NUM_FIELDS,
+						     json_object_get_string(jfield));
+
+			if (field < 0 || !(LIBRARY_TEXT_FIELDS & (1 << field))) {
+				afb_req_fail(request, "failed", "invalid fields");
+				return;
+			}
+
+			query.fields |= 1 << field;
+		}
+	}
+
+	if (json_object_object_get_ex(jargs, "offset", &val))
+		query.offset = MAX(json_object_get_int(val), 0);
+
+	if (json_object_object_get_ex(jargs, "limit", &val))
+		query.limit = MAX(json_object_get_int(val), 0);
+
+	g_mutex_lock(&mutex);
+
+	results = library_search(library, &query, &total);
+
+	jarray = json_object_new_array();
+	for (i = 0; i < results->len; i++)
+		json_object_array_add(jarray, populate_json(data, results->pdata[i]));
+
+	g_mutex_unlock(&mutex);
+
+	g_ptr_array_free(results, TRUE);
+
+	jresp = json_object_new_object();
+	json_object_object_add(jresp, "total", json_object_new_int(total));
+	json_object_object_add(jresp, "offset", json_object_new_int(query.offset));
+	json_object_object_add(jresp, "list", jarray);
+
+	afb_req_success(request, jresp, NULL);
+}
+
+/*
+ * Browse the audio items of the playlist by artist, album and track, see
+ * library_browse(). Lists the artists without @artist, the albums of @artist
+ * without @album and the tracks of @album otherwise.
+ */
+static void browse(afb_req_t request)
+{
+	json_object *jargs = afb_req_json(request);
+	CustomData *data = zone_find(afb_req_value(request, "zone"));
+	const char *artist = afb_req_value(request, "artist");
+	const char *album = afb_req_value(request, "album");
+	int offset = 0, limit = PAGE_LIMIT_DEFAULT, total = 0, i;
+	json_object *jresp, *jarray, *val = NULL;
+
+	if (!data) {
+		afb_req_fail(request, "failed", "invalid zone");
+		return;
+	}
+
+	if (album && !artist) {
+		afb_req_fail(request, "failed", "no artist was passed");
+		return;
+	}
+
+	if (json_object_object_get_ex(jargs, "offset", &val))
+		offset = MAX(json_object_get_int(val), 0);
+
+	if (json_object_object_get_ex(jargs, "limit", &val))
+		limit = MAX(json_object_get_int(val), 0);
+
+	jarray = json_object_new_array();
+
+	g_mutex_lock(&mutex);
+
+	if (album) {
+		GPtrArray *tracks = library_browse_tracks(library, artist, album,
+							  offset, limit, &total);
+
+		for (i = 0; tracks && i < tracks->len; i++)
+			json_object_array_add(jarray,
+					      populate_json(data, tracks->pdata[i]));
+
+		if (tracks)
+			g_ptr_array_free(tracks, TRUE);
+	} else {
+		GArray *groups = library_browse(library, artist, offset, limit,
+						&total);
+
+		for (i = 0; groups && i < groups->len; i++) {
+			struct library_summary *summary =
+				&g_array_index(groups, struct library_summary, i);
+			json_object *jgroup = json_object_new_object();
+
+			json_object_object_add(jgroup, artist ? "album" : "artist",
+					       json_object_new_string(summary->name));
+			if (!artist)
+				json_object_object_add(jgroup, "albums",
+						json_object_new_int(summary->albums));
+			json_object_object_add(jgroup, "tracks",
+					       json_object_new_int(summary->tracks));
+			json_object_object_add(jgroup, "duration",
+					       json_object_new_int64(summary->duration));
+			json_object_array_add(jarray, jgroup);
+		}
+
+		if (groups)
+			g_array_free(groups, TRUE);
+	}
+
+	g_mutex_unlock(&mutex);
+
+	jresp = json_object_new_object();
+	json_object_object_add(jresp, "total", json_object_new_int(total));
+	json_object_object_add(jresp, "offset", json_object_new_int(offset));
+	json_object_object_add(jresp, "list", jarray);
+
+	afb_req_success(request, jresp, NULL);
+}
+
+/*
+ * List the media paths of the play history, most recently played first or
+ * most played first, with their play counts and the playlist entry of those
+ * still in the playlist.
+ */
+static void audio_history(afb_req_t request)
+{
+	json_object *jargs = afb_req_json(request);
+	CustomData *data = zone_find(afb_req_value(request, "zone"));
+	const char *value = afb_req_value(request, "view");
+	int view = HISTORY_RECENT;
+	int offset = 0, limit = PAGE_LIMIT_DEFAULT, total = 0, i;
+	json_object *jresp, *jarray, *val = NULL;
+	GPtrArray *entries;
+
+	if (!data) {
+		afb_req_fail(request, "failed", "invalid zone");
+		return;
+	}
+
+	if (value) {
+		view = find_library_idx(history_views, HISTORY_NUM_VIEWS, value);
+		if (view < 0) {
+			afb_req_fail(request, "failed", "invalid view");
+			return;
+		}
+	}
+
+	if (json_object_object_get_ex(jargs, "offset", &val))
+		offset = MAX(json_object_get_int(val), 0);
+
+	if (json_object_object_get_ex(jargs, "limit", &val))
+		limit = MAX(json_object_get_int(val), 0);
+
+	jarray = json_object_new_array();
+
+	g_mutex_lock(&mutex);
+
+	entries = history_view(history, view, offset, limit, &total);
+
+	for (i = 0; i < entries->len; i++) {
+		struct history_entry *entry = entries->pdata[i];
+		GList *link = g_hash_table_lookup(playlist_paths, entry->path);
+		json_object *jentry = json_object_new_object();
+
+		json_object_object_add(jentry, "path",
+				       json_object_new_string(entry->path));
+		json_object_object_add(jentry, "plays",
+				       json_object_new_int(entry->plays));
+		json_object_object_add(jentry, "skips",
+				       json_object_new_int(entry->skips));
+		json_object_object_add(jentry, "skip-rate",
+				       json_object_new_double((double) entry->skips /
+							      (entry->plays + entry->skips)));
+		json_object_object_add(jentry, "last-played",
+				       json_object_new_int64(entry->last_played));
+
+		if (link)
+			json_object_object_add(jentry, "track",
+					       populate_json(data, link->data));
+
+		json_object_array_add(jarray, jentry);
+	}
+
+	g_mutex_unlock(&mutex);
+
+	g_ptr_array_free(entries, TRUE);
+
+	jresp = json_object_new_object();
+	json_object_object_add(jresp, "total", json_object_new_int(total));
+	json_object_object_add(jresp, "offset", json_object_new_int(offset));
+	json_object_object_add(jresp, "list", jarray);
+
+	afb_req_success(request, jresp, NULL);
+}
+
+static int seek_stream(CustomData *data, const char *value, int cmd)
+{
+	gint64 position, duration, current = 0;
+
+	if (value == NULL)
+		return -EINVAL;
+
+	position = strtoll(value, NULL, 10);
+
+	if (cmd != SEEK_CMD) {
+		current = MAX(position_get(data), 0);
+		position = (current / GST_MSECOND) + (cmd == FASTFORWARD_CMD ? position : -position);
+	}
+
+	if (position < 0)
+		position = 0;
+
+	duration = track_duration(data);
+	if (duration > 0 && position > duration / GST_MSECOND)
+		position = duration / GST_MSECOND;
+
+	// a simple seek always returns to normal playback speed
+	data->rate = 1.0;
+
+	fader_rebase(data->playbin, data->fader_cs);
+
+	// held at the target until the seek completes
+	position_set(data, data->segment.start + position * GST_MSECOND, NULL, 1.0);
+
+	return segment_seek(data, position);
+}
+
+/*
+ * Scan through the current track by changing the playback rate instead of
+ * issuing repeated relative seeks. Rate 1.0 returns to normal playback,
+ * negative rates play backwards from the current position to the start.
+ */
+static int set_playback_rate(CustomData *data, const char *value, int cmd)
+{
+	GstSeekFlags flags = GST_SEEK_FLAG_FLUSH;
+	gint64 current = 0;
+	gdouble rate;
+	gboolean ret;
+
+	if (value == NULL)
+		return -EINVAL;
+
+	rate = g_ascii_strtod(value, NULL);
+	if (rate == 0.0)
+		return -EINVAL;
+
+	rate = ABS(rate);
+	if (cmd == REWIND_CMD && rate != 1.0)
+		rate = -rate;
+
+	if (rate == data->rate)
+		return 0;
+
+	current = position_stream(data);
+	if (current < 0)
+		return -EINVAL;
+
+	if (rate != 1.0)
+		flags |= GST_SEEK_FLAG_TRICKMODE;
+
+	// scanned positions are not exact
+	data->index.linear = FALSE;
+
+	fader_rebase(data->playbin, data->fader_cs);
+
+	if (rate > 0)
+		ret = gst_element_seek(data->playbin, rate, GST_FORMAT_TIME, flags,
+				       GST_SEEK_TYPE_SET, current - data->index.shift,
+				       GST_SEEK_TYPE_SET, data->segment.stop >= 0 ?
+				       data->segment.stop : GST_CLOCK_TIME_NONE);
+	else
+		ret = gst_element_seek(data->playbin, rate, GST_FORMAT_TIME, flags,
+				       GST_SEEK_TYPE_SET, data->segment.start,
+				       GST_SEEK_TYPE_SET, current - data->index.shift);
+
+	if (!ret) {
+		AFB_WARNING("GSTREAMER playback rate %f not supported", rate);
+		return -EINVAL;
+	}
+
+	AFB_DEBUG("GSTREAMER playbin.rate = %f", rate);
+	data->rate = rate;
+	position_set(data, current, NULL, rate);
+
+	return 0;
+}
+
+static gboolean create_audio_filter(CustomData *data)
+{
+	GstPad *pad;
+
+	data->rgvolume = NULL;
+	data->rglimiter = NULL;
+	data->fader_cs = NULL;
+	data->fader_sync = NULL;
+
+	data->fader = gst_element_factory_make("volume", "fader");
+	if (!data->fader)
+		return FALSE;
+
+	data->audio_filter = gst_bin_new("filter");
+	gst_bin_add(GST_BIN(data->audio_filter), data->fader);
+
+	pad = gst_element_get_static_pad(data->fader, "sink");
+	gst_element_add_pad(data->audio_filter, gst_ghost_pad_new("sink", pad));
+	gst_object_unref(pad);
+
+	pad = gst_element_get_static_pad(data->fader, "src");
+	gst_element_add_pad(data->audio_filter, gst_ghost_pad_new("src", pad));
+	gst_object_unref(pad);
+
+	// the binding keeps the control source alive along with the fader
+	data->fader_cs = gst_interpolation_control_source_new();
+	g_object_set(data->fader_cs, "mode", GST_INTERPOLATION_MODE_LINEAR, NULL);
+	gst_object_add_control_binding(GST_OBJECT(data->fader),
+		gst_direct_control_binding_new_absolute(GST_OBJECT(data->fader),
+							"volume", data->fader_cs));
+	gst_object_unref(data->fader_cs);
+
+	data->fader_sync = fader_sync_new(data->fader);
+
+	// ReplayGain elements stay unlinked until normalization is enabled
+	data->rgvolume = gst_element_factory_make("rgvolume", NULL);
+	data->rglimiter = gst_element_factory_make("rglimiter", NULL);
+	if (data->rgvolume && data->rglimiter) {
+		// level all tracks the same way, including the ones never analyzed
+		g_object_set(data->rgvolume, "album-mode", FALSE, NULL);
+
+		gst_bin_add_many(GST_BIN(data->audio_filter), data->rgvolume,
+				 data->rglimiter, NULL);
+		gst_element_link(data->rgvolume, data->rglimiter);
+	} else {
+		if (data->rgvolume)
+			gst_object_unref(data->rgvolume);
+		if (data->rglimiter)
+			gst_object_unref(data->rglimiter);
+		data->rgvolume = NULL;
+		data->rglimiter = NULL;
+	}
+
+	// keep our own reference while the filter is out of the playbin
+	gst_object_ref_sink(data->audio_filter);
+
+	return TRUE;
+}
+
+/* route the audio filter through ReplayGain or not, playbin must be in NULL */
+static void audio_filter_normalize(CustomData *data, gboolean normalize)
+{
+	GstPad *ghost, *target, *current;
+
+	ghost = gst_element_get_static_pad(data->audio_filter, "sink");
+	target = gst_element_get_static_pad(normalize ? data->rgvolume : data->fader,
+					    "sink");
+	current = gst_ghost_pad_get_target(GST_GHOST_PAD(ghost));
+
+	if (current != target) {
+		gst_ghost_pad_set_target(GST_GHOST_PAD(ghost), NULL);
+
+		if (normalize)
+			gst_element_link(data->rglimiter, data->fader);
+		else
+			gst_element_unlink(data->rglimiter, data->fader);
+
+		gst_ghost_pad_set_target(GST_GHOST_PAD(ghost), target);
+		AFB_DEBUG("GSTREAMER audio-filter normalize = %d", normalize);
+	}
+
+	if (current)
+		gst_object_unref(current);
+	gst_object_unref(target);
+	gst_object_unref(ghost);
+}
+
+/*
+ * Set the buffering of the zone profile on the audio sink: the PipeWire
+ * quantum the stream asks for and the time left to upstream elements to
+ * produce each buffer. The stream picks them up when it connects.
+ */
+static void sink_profile_apply(CustomData *data)
+{
+	const char *quantum = SINK_PROFILES[data->profile].quantum;
+	gchar *properties;
+
+	if (quantum)
+		properties = g_strdup_printf("p,media.role=%s,node.latency=\"%s\"",
+					     data->role, quantum);
+	else
+		properties = g_strdup_printf("p,media.role=%s", data->role);
+
+	gst_util_set_object_arg(G_OBJECT(data->audio_sink),
+				"stream-properties", properties);
+	g_free(properties);
+
+	if (g_object_class_find_property(G_OBJECT_GET_CLASS(data->audio_sink),
+					 "processing-deadline"))
+		g_object_set(data->audio_sink, "processing-deadline",
+			     (guint64) SINK_PROFILES[data->profile].deadline * GST_MSECOND,
+			     NULL);
+}
+
+/* apply @tp to the calling thread, @name telling the threads in logs */
+static void thread_policy_apply(const struct thread_policy *tp, const char *name)
+{
+	struct sched_param param = { .sched_priority = tp->priority };
+	int ret;
+
+	if (tp->policy != SCHED_OTHER) {
+		ret = pthread_setschedparam(pthread_self(), tp->policy, &param);
+		if (ret)
+			AFB_WARNING("Cannot set %s thread scheduling: %s",
+				    name, strerror(ret));
+	}
+
+	// the nice value of a Linux thread is set through its thread id
+	if (tp->set_nice &&
+	    setpriority(PRIO_PROCESS, syscall(SYS_gettid), tp->nice) < 0)
+		AFB_WARNING("Cannot set %s thread nice value: %s",
+			    name, strerror(errno));
+
+	if (tp->set_cpus) {
+		ret = pthread_setaffinity_np(pthread_self(), sizeof(tp->cpus),
+					     &tp->cpus);
+		if (ret)
+			AFB_WARNING("Cannot set %s thread affinity: %s",
+				    name, strerror(ret));
+	}
+}
+
+/*
+ * Runs in the thread posting @msg: streaming threads of the pipeline report
+ * entering their loop, which is where they get their scheduling.
+ */
+static GstBusSyncReply stream_status_handler(GstBus *bus, GstMessage *msg,
+					     gpointer user_data)
+{
+	GstStreamStatusType type;
+
+	if (GST_MESSAGE_TYPE(msg) != GST_MESSAGE_STREAM_STATUS)
+		return GST_BUS_PASS;
+
+	gst_message_parse_stream_status(msg, &type, NULL);
+	if (type == GST_STREAM_STATUS_TYPE_ENTER)
+		thread_policy_apply(&settings.streaming_threads, "streaming");
+
+	return GST_BUS_PASS;
+}
+
+/* queue2 and multiqueue elements buffering streams */
+static void buffering_element_added(GstBin *bin, GstBin *sub_bin,
+				    GstElement *element, gpointer user_data)
+{
+	GObjectClass *klass = G_OBJECT_GET_CLASS(element);
+
+	if (!g_object_class_find_property(klass, "use-buffering") ||
+	    !g_object_class_find_property(klass, "high-watermark"))
+		return;
+
+	g_object_set(element,
+		     "low-watermark", settings.buffer_low_watermark / 100.0,
+		     "high-watermark", settings.buffer_high_watermark / 100.0,
+		     NULL);
+}
+
+/*
+ * Network streams are read ahead into a ring buffer of the buffer-size and
+ * buffer-duration settings, playback pauses once it drains below the low
+ * watermark and resumes above the high one, see buffering_update().
+ */
+static void buffering_setup(GstElement *playbin)
+{
+	guint flags = 0;
+
+	g_object_get(playbin, "flags", &flags, NULL);
+	g_object_set(playbin, "flags", flags | PLAY_FLAG_BUFFERING,
+		     "buffer-size", settings.buffer_size,
+		     "buffer-duration", settings.buffer_duration * GST_MSECOND,
+		     NULL);
+
+	g_signal_connect(playbin, "deep-element-added",
+			 G_CALLBACK(buffering_element_added), NULL);
+}
+
+/* count the buffers reaching the audio sink, see stall_check() */
+static GstPadProbeReturn stall_probe(GstPad *pad, GstPadProbeInfo *info,
+				     gpointer user_data)
+{
+	CustomData *data = user_data;
+
+	g_atomic_int_inc(&data->recovery.buffers);
+
+	return GST_PAD_PROBE_OK;
+}
+
+/* create the playbin and its elements used by zone @data */
+static int pipeline_create(CustomData *data)
+{
+	GstPad *pad;
+
+	data->playbin = gst_element_factory_make("playbin", "playbin");
+	if (!data->playbin) {
+		AFB_ERROR("GST Pipeline: Failed to create 'playbin' element!");
+		return -ENOMEM;
+	}
+
+	data->audio_sink = gst_element_factory_make("pipewiresink", NULL);
+	if (!data->audio_sink)
+	{
+		AFB_ERROR("GST Pipeline: Failed to create 'pipewiresink' element!");
+		gst_object_unref(data->playbin);
+		data->playbin = NULL;
+		return -ENOMEM;
+	}
+	sink_profile_apply(data);
+	buffering_setup(data->playbin);
+
+	// buffers this late are dropped and reported, see GST_MESSAGE_QOS
+	g_object_set(data->audio_sink, "qos", TRUE,
+		     "max-lateness", (gint64) UNDERRUN_LATENESS_MS * GST_MSECOND, NULL);
+
+	// the playbin drops its reference when the audio sink is switched
+	gst_object_ref_sink(data->audio_sink);
+
+	pad = gst_element_get_static_pad(data->audio_sink, "sink");
+	gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, stall_probe, data, NULL);
+	gst_object_unref(pad);
+
+	data->audio_filter = NULL;
+	data->fader = NULL;
+	if (create_audio_filter(data))
+		g_object_set(data->playbin, "audio-filter", data->audio_filter, NULL);
+
+	data->bus = gst_element_get_bus(data->playbin);
+	gst_bus_set_sync_handler(data->bus, stream_status_handler, NULL, NULL);
+	gst_bus_add_watch(data->bus, (GstBusFunc) handle_message, data);
+
+	return 0;
+}
+
+static void pipeline_destroy(GstElement *playbin, GstElement *audio_sink,
+			     GstElement *audio_filter, GstBus *bus)
+{
+	gst_bus_remove_watch(bus);
+	gst_object_unref(bus);
+
+	gst_element_set_state(playbin, GST_STATE_NULL);
+	gst_object_unref(playbin);
+	gst_object_unref(audio_sink);
+
+	if (audio_filter)
+		gst_object_unref(audio_filter);
+}
+
+#define CROSSFADE_MIN_MS	200
+
+/*
+ * Crossfading starts the incoming track in a second playbin, which becomes
+ * the one of the zone right away, while the outgoing playbin fades out and
+ * is torn down as soon as the fade completes. Both fades are fader ramps and
+ * both streams are mixed by PipeWire.
+ */
+
+static gint64 process_cpu_time(void)
+{
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) < 0)
+		return 0;
+
+	return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * G_USEC_PER_SEC +
+		usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static void crossfade_finish(CustomData *data)
+{
+	if (!data->outgoing.playbin)
+		return;
+
+	if (data->outgoing.timeout_id) {
+		g_source_remove(data->outgoing.timeout_id);
+		data->outgoing.timeout_id = 0;
+	}
+
+	pipeline_destroy(data->outgoing.playbin, data->outgoing.audio_sink,
+			 data->outgoing.audio_filter, data->outgoing.bus);
+	data->outgoing.playbin = NULL;
+
+	stats.crossfades++;
+	stats.crossfade_cpu = (process_cpu_time() - data->outgoing.cpu_start) / 1000;
+	stats.crossfade_cpu_total += stats.crossfade_cpu;
+
+	AFB_INFO("Crossfade over %" G_GINT64_FORMAT " ms took %" G_GINT64_FORMAT
+		 " ms of CPU time", data->outgoing.duration / 1000, stats.crossfade_cpu);
+}
+
+static gboolean crossfade_done(CustomData *data)
+{
+	g_mutex_lock(&mutex);
+
+	data->outgoing.timeout_id = 0;
+	crossfade_finish(data);
+
+	g_mutex_unlock(&mutex);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* TRUE if the current track has enough left to fade out */
+static gboolean crossfade_possible(CustomData *data)
+{
+	gint64 position = position_get(data), duration;
+
+	if (data->crossfade <= 0 || !data->playing || data->corked ||
+	    data->rate != 1.0)
+		return FALSE;
+
+	duration = track_duration(data);
+	if (position < 0 || duration < 0)
+		return FALSE;
+
+	return (duration - position) / (gint64) GST_MSECOND > CROSSFADE_MIN_MS;
+}
+
+/* crossfade to @track over @duration milliseconds */
+static int crossfade_start(CustomData *data, GList *track, gint64 duration)
+{
+	GstControlSource *fader_cs = data->fader_cs;
+	struct fader_sync *fader_sync = data->fader_sync;
+	gint64 lead;
+	int ret;
+
+	crossfade_finish(data);
+
+	data->outgoing.playbin = data->playbin;
+	data->outgoing.audio_sink = data->audio_sink;
+	data->outgoing.audio_filter = data->audio_filter;
+	data->outgoing.bus = data->bus;
+
+	ret = pipeline_create(data);
+	if (ret < 0) {
+		data->playbin = data->outgoing.playbin;
+		data->audio_sink = data->outgoing.audio_sink;
+		data->audio_filter = data->outgoing.audio_filter;
+		data->bus = data->outgoing.bus;
+		data->outgoing.playbin = NULL;
+		return ret;
+	}
+
+	lead = fader_ramp(data->outgoing.playbin, fader_cs, fader_sync, 0.0,
+			  duration);
+
+	ret = set_media_uri(data, track->data, TRUE);
+	fader_set(data->playbin, data->fader_cs, 0.0);
+	fader_ramp(data->playbin, data->fader_cs, data->fader_sync,
+		   (double) data->volume / 100.0, duration);
+	data->current_track = track;
+
+	data->outgoing.duration = duration * 1000;
+	data->outgoing.cpu_start = process_cpu_time();
+	data->outgoing.timeout_id = g_timeout_add(duration + lead,
+			(GSourceFunc) crossfade_done, data);
+
+	return ret;
+}
+
+static gboolean history_flush(gpointer user_data)
+{
+	GString *records;
+
+	g_mutex_lock(&mutex);
+	history_flush_id = 0;
+	records = history_take(history);
+	g_mutex_unlock(&mutex);
+
+	// synced to disk once per batch, and without holding mutex
+	if (records && !history_write(history, records))
+		AFB_WARNING("Cannot write the play history");
+
+	return G_SOURCE_REMOVE;
+}
+
+/*
+ * Log a play of @item to the play history, or a skip unless @played. The log
+ * is written in batches, see history_flush(). Must be called with mutex held.
+ */
+static void history_log(struct playlist_item *item, gboolean played)
+{
+	history_add(history, item->media_path, !played,
+		    g_get_real_time() / G_USEC_PER_SEC);
+
+	if (history_pending(history) >= HISTORY_BATCH) {
+		if (history_flush_id)
+			g_source_remove(history_flush_id);
+		history_flush_id = g_idle_add(history_flush, NULL);
+	} else if (!history_flush_id) {
+		history_flush_id = g_timeout_add_seconds(HISTORY_FLUSH_SECONDS,
+							 history_flush, NULL);
+	}
+}
+
+/*
+ * Log the end of the current track of @data to the play history: a play if
+ * it @finished or was heard for half of it or HISTORY_PLAYED_MS, a skip if it
+ * was left playing before that. Must be called with mutex held.
+ */
+static void history_track_end(CustomData *data, gboolean finished)
+{
+	gint64 position = position_get(data), duration = track_duration(data);
+	gboolean played = finished;
+
+	if (!data->current_track)
+		return;
+
+	if (!finished) {
+		// nothing heard, or already logged at the end of the stream
+		if (!data->playing || position < 0)
+			return;
+
+		played = position >= HISTORY_PLAYED_MS * GST_MSECOND ||
+			 (duration > 0 && position >= duration / 2);
+	}
+
+	history_log(data->current_track->data, played);
+}
+
+static int seek_track(CustomData *data, int cmd)
+{
+	GList *item = NULL;
+	int ret;
+
+	if (data->current_track == NULL)
+		return -EINVAL;
+
+	item = playlist_step_playable(data->order, data->current_track,
+				      cmd == NEXT_CMD);
+
+	if (item == NULL) {
+		if (cmd == PREVIOUS_CMD) {
+			seek_stream(data, "0", SEEK_CMD);
+			return 0;
+		}
+		return -EINVAL;
+	}
+
+	history_track_end(data, FALSE);
 
-		ret = populate_from_json(item, jdict);
-		if (!ret || g_list_find_custom(playlist, item, in_list)) {
-			g_free_playlist_item(item);
-			continue;
-		}
+	// chapters of the file being played are only a seek away
+	if (data->playing &&
+	    playlist_item_same_file(data->current_track->data, item->data)) {
+		fade_cancel(data);
+		start_cancel(data);
+		segment_set(data, item->data);
+		data->rate = 1.0;
+		fader_rebase(data->playbin, data->fader_cs);
+		position_set(data, data->segment.start, NULL, 1.0);
 
-		item->id = idx++;
-		playlist = g_list_append(playlist, item);
+		if (segment_seek(data, 0)) {
+			data->current_track = item;
+			return 0;
+		}
 	}
 
-	if (current_track == NULL) {
-		current_track = g_list_first(playlist);
-		if (current_track && current_track->data)
-			set_media_uri(current_track->data, FALSE);
-	}
+	if (cmd == NEXT_CMD && crossfade_possible(data) &&
+	    !playlist_item_same_file(data->current_track->data, item->data) &&
+	    !crossfade_start(data, item, data->crossfade))
+		return 0;
+
+	ret = set_media_uri(data, item->data, TRUE);
+	if (ret < 0)
+		return -EINVAL;
+
+	data->current_track = item;
+
+	return 0;
 }
 
-static json_object *populate_json_playlist(json_object *jresp)
+/*
+ * Returns TRUE if @error posted by @src comes from reading the media itself,
+ * such as a file that cannot be demuxed or decoded, rather than from the
+ * audio output.
+ */
+static gboolean error_is_media_fault(CustomData *data, GstObject *src,
+				     const GError *error)
 {
-	GList *l;
-	json_object *jarray = json_object_new_array();
-
-	for (l = playlist; l; l = l->next) {
-		struct playlist_item *track = l->data;
+	if (!error || !src)
+		return FALSE;
 
-		if (track && !g_strcmp0(track->media_type, "audio")) {
-			json_object *item = populate_json(track);
-			json_object_array_add(jarray, item);
-		}
-	}
+	if (src == GST_OBJECT(data->audio_sink) ||
+	    gst_object_has_as_ancestor(src, GST_OBJECT(data->audio_sink)))
+		return FALSE;
 
-	json_object_object_add(jresp, "list", jarray);
+	if (data->audio_filter &&
+	    (src == GST_OBJECT(data->audio_filter) ||
+	     gst_object_has_as_ancestor(src, GST_OBJECT(data->audio_filter))))
+		return FALSE;
 
-	return jresp;
+	return error->domain == GST_STREAM_ERROR ||
+	       g_error_matches(error, GST_CORE_ERROR,
+			       GST_CORE_ERROR_MISSING_PLUGIN);
 }
 
-static void audio_playlist(afb_req_t request)
+/*
+ * The current track failed to play: reload it where it was up to
+ * TRACK_RETRIES times. Then if @media_fault, remember its file as bad and
+ * move on to the next playable track, stopping without one. Failures of the
+ * output, such as a stall, stop the zone without blaming the file. Must be
+ * called with mutex held.
+ */
+static void track_failed(CustomData *data, const char *reason,
+			 gboolean media_fault)
 {
-	const char *value = afb_req_value(request, "list");
-	json_object *jresp = NULL;
+	GList *track = data->current_track, *next;
+	struct playlist_item *item;
+	gint64 position = MAX(position_get(data), 0) / GST_MSECOND;
 
-	g_mutex_lock(&mutex);
+	if (!track || !track->data)
+		return;
 
-	if (value) {
-		json_object *jquery;
+	item = track->data;
+	crossfade_finish(data);
 
-		if (playlist) {
-			g_list_free_full(playlist, g_free_playlist_item);
-			playlist = NULL;
-		}
+	if (data->recovery.track != track) {
+		data->recovery.track = track;
+		data->recovery.retries = 0;
+	}
 
-		jquery = json_tokener_parse(value);
-		populate_playlist(jquery);
+	if (data->recovery.retries++ < TRACK_RETRIES && !playlist_item_bad(item)) {
+		AFB_WARNING("Reloading %s: %s", item->media_path, reason);
+		set_media_uri_at(data, item, data->playing, position);
+		return;
+	}
 
-		if (playlist == NULL)
-			afb_req_fail(request, "failed", "invalid playlist");
-		else
-			afb_req_success(request, NULL, NULL);
+	// the output would fail the same on every other track
+	if (!media_fault) {
+		AFB_WARNING("Stopping on %s: %s", item->media_path, reason);
+		if (data->playing)
+			data->one_time = TRUE;
+		mediaplayer_set_role_state(data, GST_STATE_NULL);
+		return;
+	}
 
-		json_object_put(jquery);
-	} else {
-		jresp = json_object_new_object();
-		jresp = populate_json_playlist(jresp);
+	AFB_WARNING("Skipping %s: %s", item->media_path, reason);
+	stats.skips++;
 
-		afb_req_success(request, jresp, "Playlist results");
+	// network streams may well play later on
+	if (g_str_has_prefix(playlist_item_uri(item), "file://")) {
+		media_cache_stamp(bad_cache, playlist_item_uri(item));
+		g_key_file_set_string(bad_cache, playlist_item_uri(item),
+				      "error", reason);
+
+		if (!media_cache_save(bad_cache, BAD_CACHE))
+			AFB_WARNING("Cannot save bad media cache");
 	}
 
-	g_mutex_unlock(&mutex);
+	next = playlist_step_playable(data->order, track, TRUE);
+	if (!next && data->loop_state == LOOP_PLAYLIST) {
+		next = playlist_start(data->order);
+		if (next && next->data && playlist_item_bad(next->data))
+			next = playlist_step_playable(data->order, next, TRUE);
+	}
+
+	if (next && next != track) {
+		set_media_uri(data, next->data, data->playing);
+		data->current_track = next;
+	} else {
+		if (data->playing)
+			data->one_time = TRUE;
+		mediaplayer_set_role_state(data, GST_STATE_NULL);
+	}
 }
 
-static int seek_stream(const char *value, int cmd)
+/*
+ * Check that buffers still reach the audio sink while playing, recovering
+ * the track after STALL_SECONDS without any. Must be called with mutex held
+ * once a second, returns TRUE if the track was recovered.
+ */
+static gboolean stall_check(CustomData *data)
 {
-	gint64 position, current = 0;
+	GstState state = GST_STATE_NULL;
+	gint buffers;
 
-	if (value == NULL)
-		return -EINVAL;
+	gst_element_get_state(data->playbin, &state, NULL, 0);
 
-	position = strtoll(value, NULL, 10);
+	// paused for buffering, corked or prerolling to start is not stalling
+	if (state != GST_STATE_PLAYING || data->corked ||
+	    data->start.position >= 0) {
+		data->recovery.stalled = 0;
+		return FALSE;
+	}
 
-	if (cmd != SEEK_CMD) {
-		gst_element_query_position (data.playbin, GST_FORMAT_TIME, &current);
-		position = (current / GST_MSECOND) + (FASTFORWARD_CMD ? position : -position);
+	buffers = g_atomic_int_get(&data->recovery.buffers);
+	if (buffers != data->recovery.checked) {
+		data->recovery.checked = buffers;
+		data->recovery.stalled = 0;
+		return FALSE;
 	}
 
-	if (position < 0)
-		position = 0;
+	if (++data->recovery.stalled < STALL_SECONDS)
+		return FALSE;
 
-	if (data.duration > 0 && position > data.duration)
-		position = data.duration;
+	data->recovery.stalled = 0;
+	stats.stalls++;
+	track_failed(data, "playback stalled", FALSE);
 
-	return gst_element_seek_simple(data.playbin, GST_FORMAT_TIME,
-				GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT,
-				position * GST_MSECOND);
+	return TRUE;
 }
 
-static int seek_track(int cmd)
+/*
+ * Switch zone @data to the buffering @profile, reconnecting the stream of a
+ * loaded track at its current position. Must be called with mutex held.
+ */
+static void sink_profile_set(CustomData *data, int profile)
 {
-	GList *item = NULL;
-	int ret;
+	gint64 position = MAX(position_get(data), 0) / GST_MSECOND;
 
-	if (current_track == NULL)
-		return -EINVAL;
+	if (profile == data->profile)
+		return;
 
-	item = (cmd == NEXT_CMD) ? current_track->next : current_track->prev;
+	data->profile = profile;
+	crossfade_finish(data);
+	sink_profile_apply(data);
 
-	if (item == NULL) {
-		if (cmd == PREVIOUS_CMD) {
-			seek_stream("0", SEEK_CMD);
-			return 0;
-		}
-		return -EINVAL;
-	}
+	// a released pipeline reconnects when resumed
+	if (data->idle.released || !data->current_track ||
+	    !data->current_track->data)
+		return;
 
-	ret = set_media_uri(item->data, TRUE);
-	if (ret < 0)
-		return -EINVAL;
+	set_media_uri_at(data, data->current_track->data, data->playing, position);
+}
 
-	current_track = item;
+/* output latency reported by the pipeline in nanoseconds, -1 if unknown */
+static gint64 sink_latency(CustomData *data)
+{
+	GstQuery *query = gst_query_new_latency();
+	GstClockTime min = GST_CLOCK_TIME_NONE;
+	gboolean live = FALSE;
 
-	return 0;
+	if (gst_element_query(data->playbin, query))
+		gst_query_parse_latency(query, &live, &min, NULL);
+
+	gst_query_unref(query);
+
+	return GST_CLOCK_TIME_IS_VALID(min) ? (gint64) min : -1;
 }
 
 static int avrcp_cmd(afb_api_t api, const char *action)
@@ -440,62 +3465,81 @@ static void avrcp_controls(afb_req_t request)
 	afb_req_success(request, NULL, NULL);
 }
 
-static void gstreamer_controls(afb_req_t request)
+static int controls_play(CustomData *data)
+{
+	GstElement *obj = NULL;
+
+	g_object_get(data->playbin, "audio-sink", &obj, NULL);
+
+	if (obj == data->fake_sink || data->idle.released) {
+		gint64 position = MAX(position_get(data), 0) / GST_MSECOND;
+
+		if (!data->current_track || !data->current_track->data)
+			return -ENOENT;
+
+		if (data->idle.released)
+			data->idle.resume_start = g_get_monotonic_time();
+
+		// resume from a position sought while stopped or released
+		set_media_uri_at(data, data->current_track->data, TRUE, position);
+	} else {
+		g_object_set(data->playbin, "audio-sink", data->audio_sink, NULL);
+		AFB_DEBUG("GSTREAMER playbin.audio-sink = pipewire-sink");
+
+		data->playing = TRUE;
+		fade_in(data);
+	}
+
+	return 0;
+}
+
+static void controls_pause(CustomData *data)
+{
+	json_object *jresp;
+
+	crossfade_finish(data);
+#ifdef WIREPLUMBER_WORKAROUND
+	fade_out(data, GST_STATE_READY);
+#else
+	fade_out(data, GST_STATE_PAUSED);
+#endif
+	data->playing = FALSE;
+	data->corked = FALSE;
+	data->rate = 1.0;
+
+	/* metadata event */
+	jresp = populate_json_metadata(data);
+	json_object_object_add(jresp, "status",
+			       json_object_new_string("stopped"));
+	metadata_push(data, jresp, METADATA_TRACK);
+}
+
+static void gstreamer_controls(CustomData *data, afb_req_t request)
 {
 	const char *value = afb_req_value(request, "value");
 	const char *position = afb_req_value(request, "position");
 	int cmd = get_command_index(value);
-	afb_api_t api = afb_req_get_api(request);
 	json_object *jresp = NULL;
 
 	errno = 0;
 
 	switch (cmd) {
-	case PLAY_CMD: {
-		GstElement *obj = NULL;
-
-		if (data.playing) {
+	case PLAY_CMD:
+		if (data->playing) {
 			afb_req_fail(request, "failed", "Already playing");
 			return;
 		}
 
-		g_object_get(data.playbin, "audio-sink", &obj, NULL);
-
-		if (obj == data.fake_sink) {
-			if (current_track && current_track->data)
-				set_media_uri(current_track->data, TRUE);
-			else {
-				afb_req_fail(request, "failed", "No playlist");
-				return;
-			}
-		} else {
-			g_object_set(data.playbin, "audio-sink", data.audio_sink, NULL);
-			AFB_DEBUG("GSTREAMER playbin.audio-sink = pipewire-sink");
-
-			mediaplayer_set_role_state(api, GST_STATE_PLAYING);
-			AFB_DEBUG("GSTREAMER playbin.state = GST_STATE_PLAYING");
+		if (controls_play(data) < 0) {
+			afb_req_fail(request, "failed", "No playlist");
+			return;
 		}
 
 		jresp = json_object_new_object();
 		json_object_object_add(jresp, "playing", json_object_new_boolean(TRUE));
 		break;
-	}
 	case PAUSE_CMD:
-#ifdef WIREPLUMBER_WORKAROUND
-		mediaplayer_set_role_state(api, GST_STATE_READY);
-		AFB_DEBUG("GSTREAMER playbin.state = GST_STATE_READY");
-#else
-		mediaplayer_set_role_state(api, GST_STATE_PAUSED);
-		AFB_DEBUG("GSTREAMER playbin.state = GST_STATE_PAUSED");
-#endif
-		data.playing = FALSE;
-		data.corked = FALSE;
-
-		/* metadata event */
-		jresp = populate_json_metadata();
-		json_object_object_add(jresp, "status",
-				       json_object_new_string("stopped"));
-		afb_event_push(metadata_event, jresp);
+		controls_pause(data);
 
 		/* status returned */
 		jresp = json_object_new_object();
@@ -503,13 +3547,34 @@ static void gstreamer_controls(afb_req_t request)
 		break;
 	case PREVIOUS_CMD:
 	case NEXT_CMD:
-		seek_track(cmd);
+		seek_track(data, cmd);
 		break;
 	case SEEK_CMD:
+		seek_stream(data, position, cmd);
+		break;
 	case FASTFORWARD_CMD:
-	case REWIND_CMD:
-		seek_stream(position, cmd);
+	case REWIND_CMD: {
+		const char *rate = afb_req_value(request, "rate");
+
+		if (!rate) {
+			seek_stream(data, position, cmd);
+			break;
+		}
+
+		if (!data->playing) {
+			afb_req_fail(request, "failed", "Not playing");
+			return;
+		}
+
+		if (set_playback_rate(data, rate, cmd) < 0) {
+			afb_req_fail(request, "failed", "invalid rate");
+			return;
+		}
+
+		jresp = json_object_new_object();
+		json_object_object_add(jresp, "rate", json_object_new_double(data->rate));
 		break;
+	}
 	case PICKTRACK_CMD: {
 		const char *parameter = afb_req_value(request, "index");
 		long int idx = strtol(parameter, NULL, 10);
@@ -523,8 +3588,9 @@ static void gstreamer_controls(afb_req_t request)
 		list = find_media_index(playlist, idx);
 		if (list != NULL) {
 			struct playlist_item *item = list->data;
-			set_media_uri(item, TRUE);
-			current_track = list;
+			history_track_end(data, FALSE);
+			set_media_uri(data, item, TRUE);
+			data->current_track = list;
 		} else {
 			afb_req_fail(request, "failed", "couldn't find index");
 			return;
@@ -554,21 +3620,88 @@ static void gstreamer_controls(afb_req_t request)
 		if (volume > 100)
 			volume = 100;
 
-		g_object_set(data.playbin, "volume", (double) volume / 100.0, NULL);
+		// a pending fade out keeps going, play fades in to the new volume
+		if (!data->fade.timeout_id)
+			fader_ramp(data->playbin, data->fader_cs,
+				   data->fader_sync, (double) volume / 100.0,
+				   data->playing ? VOLUME_RAMP_MS : 0);
 		AFB_DEBUG("GSTREAMER volume = %f", (double) volume / 100.0);
 
-		data.volume = volume;
+		data->volume = volume;
 
 		break;
 	}
 	case LOOP_CMD:
-		data.loop_state =
+		data->loop_state =
 			find_loop_state_idx(afb_req_value(request, "state"));
 		break;
 	case STOP_CMD:
-		mediaplayer_set_role_state(api, GST_STATE_NULL);
-		AFB_DEBUG("GSTREAMER playbin.state = GST_STATE_NULL");
+		crossfade_finish(data);
+		data->playing = FALSE;
+		fade_out(data, GST_STATE_NULL);
+		break;
+	case NORMALIZE_CMD: {
+		const char *state = afb_req_value(request, "state");
+
+		if (!data->rgvolume) {
+			afb_req_fail(request, "failed", "normalization unavailable");
+			return;
+		}
+
+		// applied from the next track on
+		data->normalize = !g_strcmp0(state, "on");
+
+		jresp = json_object_new_object();
+		json_object_object_add(jresp, "normalize",
+				       json_object_new_boolean(data->normalize));
+		break;
+	}
+	case CROSSFADE_CMD: {
+		const char *parameter = afb_req_value(request, "duration");
+
+		if (!parameter) {
+			afb_req_fail(request, "failed", "invalid duration");
+			return;
+		}
+
+		data->crossfade = MAX(g_ascii_strtoll(parameter, NULL, 10), 0);
+
+		jresp = json_object_new_object();
+		json_object_object_add(jresp, "crossfade",
+				       json_object_new_int64(data->crossfade));
+		break;
+	}
+	case ORDER_CMD: {
+		int order = find_playlist_order_idx(afb_req_value(request, "sort"),
+						    -EINVAL);
+
+		if (order < 0) {
+			afb_req_fail(request, "failed", "invalid sort");
+			return;
+		}
+
+		data->order = order;
+
+		jresp = json_object_new_object();
+		json_object_object_add(jresp, "order",
+				       json_object_new_string(library_orders[order]));
+		break;
+	}
+	case PROFILE_CMD: {
+		int profile = find_sink_profile_idx(afb_req_value(request, "profile"));
+
+		if (profile < 0) {
+			afb_req_fail(request, "failed", "invalid profile");
+			return;
+		}
+
+		sink_profile_set(data, profile);
+
+		jresp = json_object_new_object();
+		json_object_object_add(jresp, "profile",
+				       json_object_new_string(SINK_PROFILES[profile].name));
 		break;
+	}
 	default:
 		afb_req_fail(request, "failed", "unknown command");
 		return;
@@ -577,6 +3710,270 @@ static void gstreamer_controls(afb_req_t request)
 	afb_req_success(request, jresp, NULL);
 }
 
+/* combined effect of a batch of controls, fields are -1 when unchanged */
+struct controls_plan {
+	GList *track;		/* track to load, NULL to keep the current one */
+	gint64 position;	/* milliseconds */
+	int playing;
+	gboolean stop;		/* stopped after loading the track */
+	long int volume;
+	int loop_state;
+	int normalize;
+	gint64 crossfade;
+	int order;
+	int profile;
+};
+
+static const char *batch_value(json_object *jcmd, const char *name)
+{
+	json_object *val = NULL;
+
+	if (!json_object_object_get_ex(jcmd, name, &val))
+		return NULL;
+
+	return json_object_get_string(val);
+}
+
+/*
+ * Fold the commands of @jbatch into @plan without touching the zone, returns
+ * an error message if one of them is invalid.
+ */
+static const char *controls_plan(CustomData *data, json_object *jbatch,
+				 struct controls_plan *plan)
+{
+	GList *track = data->current_track;
+	gint64 position = -1;
+	int i, order = data->order;
+
+	for (i = 0; i < json_object_array_length(jbatch); i++) {
+		json_object *jcmd = json_object_array_get_idx(jbatch, i);
+		const char *parameter;
+		int cmd = get_command_index(batch_value(jcmd, "value"));
+
+		switch (cmd) {
+		case PLAY_CMD:
+		case PAUSE_CMD:
+			// playing again after a stop starts the track over
+			if (plan->stop && position < 0)
+				position = 0;
+			plan->stop = FALSE;
+			plan->playing = cmd == PLAY_CMD;
+			break;
+		case STOP_CMD:
+			plan->stop = TRUE;
+			plan->playing = FALSE;
+			position = -1;
+			break;
+		case PREVIOUS_CMD:
+		case NEXT_CMD: {
+			GList *item = track ? playlist_step_playable(order, track,
+						cmd == NEXT_CMD) : NULL;
+
+			if (item) {
+				track = plan->track = item;
+				position = -1;
+			} else if (cmd == PREVIOUS_CMD) {
+				position = 0;
+			} else {
+				return "no next track";
+			}
+			break;
+		}
+		case SEEK_CMD:
+		case FASTFORWARD_CMD:
+		case REWIND_CMD: {
+			gint64 offset;
+
+			parameter = batch_value(jcmd, "position");
+			if (!parameter || batch_value(jcmd, "rate"))
+				return "invalid position";
+
+			offset = g_ascii_strtoll(parameter, NULL, 10);
+
+			if (cmd == SEEK_CMD)
+				position = offset;
+			else {
+				if (position < 0)
+					position = plan->track ? 0 :
+						   MAX(position_get(data), 0) / GST_MSECOND;
+				position += cmd == FASTFORWARD_CMD ? offset : -offset;
+			}
+
+			position = MAX(position, 0);
+			break;
+		}
+		case PICKTRACK_CMD:
+			parameter = batch_value(jcmd, "index");
+			if (!parameter)
+				return "invalid index";
+
+			track = find_media_index(playlist,
+						 g_ascii_strtoll(parameter, NULL, 10));
+			if (!track)
+				return "couldn't find index";
+
+			plan->track = track;
+			position = -1;
+			break;
+		case VOLUME_CMD:
+			parameter = batch_value(jcmd, "volume");
+			if (!parameter)
+				return "invalid volume";
+
+			plan->volume = CLAMP(g_ascii_strtoll(parameter, NULL, 10), 0, 100);
+			break;
+		case LOOP_CMD:
+			plan->loop_state = find_loop_state_idx(batch_value(jcmd, "state"));
+			break;
+		case NORMALIZE_CMD:
+			if (!data->rgvolume)
+				return "normalization unavailable";
+
+			plan->normalize = !g_strcmp0(batch_value(jcmd, "state"), "on");
+			break;
+		case CROSSFADE_CMD:
+			parameter = batch_value(jcmd, "duration");
+			if (!parameter)
+				return "invalid duration";
+
+			plan->crossfade = MAX(g_ascii_strtoll(parameter, NULL, 10), 0);
+			break;
+		case ORDER_CMD:
+			order = find_playlist_order_idx(batch_value(jcmd, "sort"), -EINVAL);
+			if (order < 0)
+				return "invalid sort";
+
+			plan->order = order;
+			break;
+		case PROFILE_CMD:
+			plan->profile = find_sink_profile_idx(batch_value(jcmd, "profile"));
+			if (plan->profile < 0)
+				return "invalid profile";
+			break;
+		default:
+			return "unknown command";
+		}
+	}
+
+	if (plan->playing == TRUE && (!track || !track->data))
+		return "No playlist";
+
+	// a stopped track starts over
+	plan->position = plan->stop ? -1 : position;
+
+	return NULL;
+}
+
+/*
+ * Apply a list of controls atomically: settings are changed first, then the
+ * track is loaded once, started at the final position and played, paused or
+ * stopped as the last play, pause or stop command requested.
+ */
+static void controls_batch(CustomData *data, afb_req_t request,
+			   json_object *jbatch)
+{
+	struct controls_plan plan = {
+		.track = NULL,
+		.position = -1,
+		.playing = -1,
+		.stop = FALSE,
+		.volume = -1,
+		.loop_state = -1,
+		.normalize = -1,
+		.crossfade = -1,
+		.order = -1,
+		.profile = -1,
+	};
+	const char *error;
+	json_object *jresp;
+	gboolean playing;
+
+	if (!json_object_is_type(jbatch, json_type_array)) {
+		afb_req_fail(request, "failed", "invalid batch");
+		return;
+	}
+
+	error = controls_plan(data, jbatch, &plan);
+	if (error) {
+		afb_req_fail(request, "failed", error);
+		return;
+	}
+
+	if (plan.order >= 0)
+		data->order = plan.order;
+	if (plan.loop_state >= 0)
+		data->loop_state = plan.loop_state;
+	if (plan.crossfade >= 0)
+		data->crossfade = plan.crossfade;
+	if (plan.normalize >= 0)
+		data->normalize = plan.normalize;
+
+	// a track loaded by the batch connects with the new profile anyway
+	if (plan.profile >= 0 && plan.track) {
+		data->profile = plan.profile;
+		sink_profile_apply(data);
+	} else if (plan.profile >= 0) {
+		sink_profile_set(data, plan.profile);
+	}
+
+	if (plan.volume >= 0 && plan.volume != data->volume) {
+		data->volume = plan.volume;
+
+		// a newly loaded track starts at the new volume
+		if (!plan.track && !data->fade.timeout_id)
+			fader_ramp(data->playbin, data->fader_cs,
+				   data->fader_sync,
+				   (double) data->volume / 100.0,
+				   data->playing ? VOLUME_RAMP_MS : 0);
+	}
+
+	playing = plan.playing >= 0 ? plan.playing : data->playing;
+
+	if (plan.track) {
+		history_track_end(data, FALSE);
+		crossfade_finish(data);
+		set_media_uri_at(data, plan.track->data, playing,
+				 MAX(plan.position, 0));
+		data->current_track = plan.track;
+
+		// loaded paused, or playing once prerolled
+		data->playing = playing;
+	} else if (!plan.stop) {
+		if (plan.position >= 0) {
+			gchar *position = g_strdup_printf("%" G_GINT64_FORMAT,
+							  plan.position);
+
+			seek_stream(data, position, SEEK_CMD);
+			g_free(position);
+		}
+
+		if (playing && !data->playing)
+			controls_play(data);
+		else if (!playing && data->playing)
+			controls_pause(data);
+	}
+
+	if (plan.stop) {
+		crossfade_finish(data);
+		data->playing = FALSE;
+		fade_out(data, GST_STATE_NULL);
+	}
+
+	jresp = json_object_new_object();
+	json_object_object_add(jresp, "playing", json_object_new_boolean(playing));
+	if (data->current_track && data->current_track->data) {
+		struct playlist_item *item = data->current_track->data;
+
+		json_object_object_add(jresp, "index", json_object_new_int(item->id));
+	}
+	if (plan.position >= 0)
+		json_object_object_add(jresp, "position",
+				       json_object_new_int64(plan.position));
+	json_object_object_add(jresp, "volume", json_object_new_int64(data->volume));
+
+	afb_req_success(request, jresp, NULL);
+}
+
 /* @value can be one of the following values:
  *   play     - go to playing transition
  *   pause    - go to pause transition
@@ -584,17 +3981,46 @@ static void gstreamer_controls(afb_req_t request)
  *   next     - skip to the next track
  *   seek     - go to position (in milliseconds)
  *
- *   fast-forward - skip forward in milliseconds
- *   rewind       - skip backward in milliseconds
+ *   fast-forward - skip forward in milliseconds, or scan forward at
+ *                  the playback rate passed in @rate
+ *   rewind       - skip backward in milliseconds, or scan backward at
+ *                  the playback rate passed in @rate
  *
  *   pick-track   - select track via index number
  *   volume       - set volume between 0 - 100%
  *   loop         - set looping of playlist (true or false)
+ *   normalize    - set loudness normalization (on or off)
+ *   crossfade    - set crossfade duration between tracks in milliseconds
+ *   order        - set playback order (index, title, artist, path, duration
+ *                  or added)
+ *
+ * A list of such commands passed in @batch instead is applied at once, see
+ * controls_batch().
  */
 
 static void controls(afb_req_t request)
 {
 	const char *value = afb_req_value(request, "value");
+	CustomData *data = zone_find(afb_req_value(request, "zone"));
+	json_object *jbatch = NULL;
+
+	if (!data) {
+		afb_req_fail(request, "failed", "invalid zone");
+		return;
+	}
+
+	if (json_object_object_get_ex(afb_req_json(request), "batch", &jbatch)) {
+		g_mutex_lock(&mutex);
+
+		if (data->avrcp_connected)
+			afb_req_fail(request, "failed", "batch unavailable with Bluetooth");
+		else
+			controls_batch(data, request, jbatch);
+
+		state_publish(data);
+		g_mutex_unlock(&mutex);
+		return;
+	}
 
 	if (!value) {
 		afb_req_fail(request, "failed", "no value was passed");
@@ -602,13 +4028,14 @@ static void controls(afb_req_t request)
 	}
 
 	g_mutex_lock(&mutex);
-	if (data.avrcp_connected || !g_strcmp0(value, "connect")) {
+	if (data->avrcp_connected || !g_strcmp0(value, "connect")) {
 		g_mutex_unlock(&mutex);
 		avrcp_controls(request);
 		return;
 	}
 
-	gstreamer_controls(request);
+	gstreamer_controls(data, request);
+	state_publish(data);
 	g_mutex_unlock(&mutex);
 }
 
@@ -670,39 +4097,123 @@ static gchar *get_album_art(GstTagList *tags)
 	return NULL;
 }
 
-static json_object *populate_json_metadata(void)
+static json_object *populate_json_metadata(CustomData *data)
 {
-	struct playlist_item *track;
 	json_object *jresp, *metadata;
+	gint64 position = position_get(data);
 
-	if (current_track == NULL || current_track->data == NULL)
+	if (data->current_track == NULL || data->current_track->data == NULL)
 		return NULL;
 
-	track = current_track->data;
-	metadata = populate_json(track);
+	metadata = populate_json_selected(data, data->current_track->data);
 	jresp = json_object_new_object();
 
-	if (data.duration != GST_CLOCK_TIME_NONE)
-		json_object_object_add(metadata, "duration",
-			       json_object_new_int64(data.duration / GST_MSECOND));
-
-	if (data.position != GST_CLOCK_TIME_NONE)
+	if (position >= 0)
 		json_object_object_add(jresp, "position",
-			       json_object_new_int64(data.position / GST_MSECOND));
+			       json_object_new_int64(position / GST_MSECOND));
 
 	json_object_object_add(jresp, "volume",
-			       json_object_new_int64(data.volume));
+			       json_object_new_int64(data->volume));
 
 	json_object_object_add(jresp, "track", metadata);
 
 	return jresp;
 }
 
+static void state_snapshot_unref(struct state_snapshot *snap)
+{
+	if (!snap || !g_atomic_int_dec_and_test(&snap->refcount))
+		return;
+
+	json_object_put(snap->track);
+	g_free(snap);
+}
+
+/* Returns a reference to the state last published by zone @data, or NULL */
+static struct state_snapshot *state_snapshot_get(CustomData *data)
+{
+	struct state_snapshot *snap;
+
+	g_mutex_lock(&snapshot_mutex);
+	snap = data->snapshot;
+	if (snap)
+		g_atomic_int_inc(&snap->refcount);
+	g_mutex_unlock(&snapshot_mutex);
+
+	return snap;
+}
+
+static gboolean state_snapshot_equal(const struct state_snapshot *a,
+				     const struct state_snapshot *b)
+{
+	return a->playing == b->playing && a->corked == b->corked &&
+	       a->loop_state == b->loop_state && a->order == b->order &&
+	       a->volume == b->volume && a->rate == b->rate &&
+	       a->normalize == b->normalize && a->crossfade == b->crossfade &&
+	       a->avrcp_connected == b->avrcp_connected &&
+	       a->track_revision == b->track_revision &&
+	       a->track_duration == b->track_duration;
+}
+
+/*
+ * Publish the state of zone @data for the state verb, which reads it without
+ * taking mutex. Snapshots are reference counted, the one replaced is freed
+ * once the last reader is done with it, and nothing is published unless the
+ * state changed. Must be called with mutex held after state changes.
+ */
+static void state_publish(CustomData *data)
+{
+	struct state_snapshot current = {
+		.refcount = 1,
+		.playing = data->playing,
+		.corked = data->corked,
+		.loop_state = data->loop_state,
+		.order = data->order,
+		.volume = data->volume,
+		.rate = data->rate,
+		.normalize = data->normalize,
+		.crossfade = data->crossfade,
+		.avrcp_connected = data->avrcp_connected,
+	};
+	struct state_snapshot *snap, *old = data->snapshot;
+
+	// the selected entry is only built when the track or its duration changes
+	if (data->current_track && data->current_track->data) {
+		struct playlist_item *track = data->current_track->data;
+
+		current.track_revision = track->revision;
+		current.track_duration = selected_duration(data, track);
+	}
+
+	if (old && state_snapshot_equal(old, &current))
+		return;
+
+	snap = g_new(struct state_snapshot, 1);
+	*snap = current;
+	if (data->current_track && data->current_track->data)
+		snap->track = populate_json_fields(data->current_track->data,
+						   current.track_duration, TRUE);
+
+	g_mutex_lock(&snapshot_mutex);
+	data->snapshot = snap;
+	g_mutex_unlock(&snapshot_mutex);
+
+	state_snapshot_unref(old);
+}
+
+/*
+ * Subscribe to the Bluetooth media events the first time a client subscribes
+ * to metadata, they are then relayed to all metadata subscribers.
+ */
 static int bluetooth_subscribe(afb_api_t api)
 {
+	static gint subscribed;
 	json_object *response, *query;
 	int ret;
 
+	if (g_atomic_int_get(&subscribed))
+		return 0;
+
 	query = json_object_new_object();
 	json_object_object_add(query, "value", json_object_new_string("media"));
 
@@ -714,40 +4225,367 @@ static int bluetooth_subscribe(afb_api_t api)
 		return ret;
 	}
 
+	g_atomic_int_set(&subscribed, TRUE);
+
 	return 0;
 }
 
+static int find_metadata_field_idx(const char *field)
+{
+	int idx;
+
+	for (idx = 0; METADATA_FIELDS[idx]; idx++) {
+		if (!g_strcmp0(METADATA_FIELDS[idx], field))
+			return idx;
+	}
+
+	return -EINVAL;
+}
+
+static gboolean metadata_field_wanted(struct metadata_channel *channel,
+				      const char *field)
+{
+	int idx = find_metadata_field_idx(field);
+
+	/* pass through anything that isn't a selectable field */
+	if (idx < 0)
+		return TRUE;
+
+	return !!(channel->fields & (1 << idx));
+}
+
+/*
+ * Build the payload a channel receives out of @jresp, or NULL if the channel
+ * isn't interested in it at all. The payload shares the values of @jresp,
+ * which must not be modified afterwards.
+ */
+static json_object *metadata_filter(struct metadata_channel *channel,
+				    json_object *jresp)
+{
+	json_object *jfiltered;
+
+	if (!jresp || !json_object_is_type(jresp, json_type_object))
+		return NULL;
+
+	jfiltered = json_object_new_object();
+
+	json_object_object_foreach(jresp, key, val) {
+		if (!strcmp(key, "track") && json_object_is_type(val, json_type_object)) {
+			json_object *jtrack = json_object_new_object();
+			json_object_object_foreach(val, tkey, tval) {
+				if (!channel->art && !strcmp(tkey, "image"))
+					continue;
+				if (metadata_field_wanted(channel, tkey))
+					json_object_object_add(jtrack, tkey,
+						json_object_get(tval));
+			}
+
+			if (json_object_object_length(jtrack) > 0)
+				json_object_object_add(jfiltered, key, jtrack);
+			else
+				json_object_put(jtrack);
+		} else if (metadata_field_wanted(channel, key)) {
+			json_object_object_add(jfiltered, key,
+					       json_object_get(val));
+		}
+	}
+
+	if (json_object_object_length(jfiltered) == 0) {
+		json_object_put(jfiltered);
+		return NULL;
+	}
+
+	return jfiltered;
+}
+
+static void metadata_channel_free(struct metadata_channel *channel)
+{
+	afb_event_unref(channel->event);
+	g_free(channel->name);
+	g_free(channel);
+}
+
+/*
+ * Push @jresp to the metadata event of zone @data and a filtered copy of it
+ * to every metadata channel of the zone that wants this @kind of payload. Takes ownership of
+ * @jresp. Channels nobody listens to anymore are dropped.
+ */
+static void metadata_push(CustomData *data, json_object *jresp, int kind)
+{
+	gint64 now = g_get_monotonic_time();
+	GList *l;
+
+	g_mutex_lock(&channel_mutex);
+
+	l = metadata_channels;
+	while (l) {
+		struct metadata_channel *channel = l->data;
+		json_object *jfiltered = NULL;
+		int ret;
+
+		l = l->next;
+
+		if (channel->zone != data)
+			continue;
+
+		switch (kind) {
+		case METADATA_POSITION:
+			if (channel->interval > 0 &&
+			    now - channel->last_position < channel->interval * 1000)
+				continue;
+			jfiltered = metadata_filter(channel, jresp);
+			break;
+		case METADATA_ART:
+			if (channel->art)
+				jfiltered = metadata_filter(channel, jresp);
+			break;
+		case METADATA_BLUETOOTH:
+			if (channel->bluetooth)
+				jfiltered = json_object_get(jresp);
+			break;
+		case METADATA_SIGNAL:
+			if (channel->signals)
+				jfiltered = json_object_get(jresp);
+			break;
+		default:
+			jfiltered = metadata_filter(channel, jresp);
+			break;
+		}
+
+		if (!jfiltered)
+			continue;
+
+		// the interval runs from the last position actually pushed
+		if (kind == METADATA_POSITION)
+			channel->last_position = now;
+
+		ret = afb_event_push(channel->event, jfiltered);
+		if (ret == 0) {
+			AFB_DEBUG("Dropping unused metadata channel %s", channel->name);
+			metadata_channels = g_list_remove(metadata_channels, channel);
+			metadata_channel_free(channel);
+		}
+	}
+
+	g_mutex_unlock(&channel_mutex);
+
+	afb_event_push(data->metadata_event, jresp);
+}
+
+/*
+ * Resolve the metadata channel of zone @data matching the subscription
+ * options of @request, creating it if @create is set. Returns NULL for the
+ * default unfiltered metadata event of the zone. Must be called with
+ * channel_mutex held.
+ */
+static struct metadata_channel *metadata_channel_get(CustomData *data,
+						     afb_req_t request,
+						     gboolean create,
+						     int *error)
+{
+	json_object *jargs = afb_req_json(request);
+	json_object *val = NULL;
+	struct metadata_channel *channel;
+	guint fields = METADATA_FIELDS_ALL;
+	gint64 interval = 0;
+	gboolean art = TRUE, bluetooth = TRUE, signals = TRUE;
+	gchar *event, *name;
+	GList *l;
+
+	*error = 0;
+
+	if (json_object_object_get_ex(jargs, "fields", &val)) {
+		int i;
+
+		if (!json_object_is_type(val, json_type_array)) {
+			*error = -EINVAL;
+			return NULL;
+		}
+
+		fields = 0;
+		for (i = 0; i < json_object_array_length(val); i++) {
+			const char *field = json_object_get_string(
+					json_object_array_get_idx(val, i));
+			int idx = find_metadata_field_idx(field);
+
+			if (idx < 0) {
+				*error = -EINVAL;
+				return NULL;
+			}
+			fields |= 1 << idx;
+		}
+	}
+
+	if (json_object_object_get_ex(jargs, "interval", &val))
+		interval = MAX(json_object_get_int64(val), 0);
+
+	if (json_object_object_get_ex(jargs, "art", &val))
+		art = json_object_get_boolean(val);
+
+	if (json_object_object_get_ex(jargs, "bluetooth", &val))
+		bluetooth = json_object_get_boolean(val);
+
+	if (json_object_object_get_ex(jargs, "signals", &val))
+		signals = json_object_get_boolean(val);
+
+	if (fields == METADATA_FIELDS_ALL && !interval && art && bluetooth && signals)
+		return NULL;
+
+	event = zone_event_name(data, "metadata");
+	name = g_strdup_printf("%s.%x.%" G_GINT64_FORMAT ".%d%d%d", event,
+			       fields, interval, art, bluetooth, signals);
+	g_free(event);
+
+	for (l = metadata_channels; l; l = l->next) {
+		channel = l->data;
+
+		if (!g_strcmp0(channel->name, name)) {
+			g_free(name);
+			return channel;
+		}
+	}
+
+	if (!create) {
+		g_free(name);
+		*error = -ENOENT;
+		return NULL;
+	}
+
+	channel = g_malloc0(sizeof(*channel));
+	channel->event = afb_daemon_make_event(name);
+	channel->name = name;
+	channel->zone = data;
+	channel->fields = fields;
+	channel->interval = interval;
+	channel->art = art;
+	channel->bluetooth = bluetooth;
+	channel->signals = signals;
+
+	if (!afb_event_is_valid(channel->event)) {
+		metadata_channel_free(channel);
+		*error = -ENOMEM;
+		return NULL;
+	}
+
+	metadata_channels = g_list_append(metadata_channels, channel);
+
+	return channel;
+}
+
+/*
+ * Add the name of the zone @event to the subscription reply @jresp, which
+ * may be NULL. Events of the first zone keep their plain name, so it is only
+ * added there when @always is set.
+ */
+static json_object *zone_event_reply(CustomData *data, json_object *jresp,
+				     const char *event, gboolean always)
+{
+	gchar *name;
+
+	if (data == &zones[0] && !always)
+		return jresp;
+
+	if (!jresp)
+		jresp = json_object_new_object();
+
+	name = zone_event_name(data, event);
+	json_object_object_add(jresp, "event", json_object_new_string(name));
+	g_free(name);
+
+	return jresp;
+}
+
+/*
+ * The current state is returned in the reply of the subscribe verb rather
+ * than pushed on the event, which would send it again to every client that
+ * already subscribed.
+ */
 static void subscribe(afb_req_t request)
 {
 	const char *value = afb_req_value(request, "value");
+	CustomData *data = zone_find(afb_req_value(request, "zone"));
 
-	if (!strcasecmp(value, "metadata")) {
-		afb_api_t api = afb_req_get_api(request);
-		json_object *jresp = NULL;
+	if (!value) {
+		afb_req_fail(request, "failed", "no value was passed");
+		return;
+	}
 
-		afb_req_subscribe(request, metadata_event);
-		afb_req_success(request, NULL, NULL);
+	if (!data) {
+		afb_req_fail(request, "failed", "invalid zone");
+		return;
+	}
+
+	if (!strcasecmp(value, "metadata")) {
+		struct metadata_channel *channel;
+		json_object *jresp, *jmetadata;
+		int ret;
 
 		g_mutex_lock(&mutex);
-		jresp = populate_json_metadata();
+		jmetadata = populate_json_metadata(data);
 		g_mutex_unlock(&mutex);
 
-		afb_event_push(metadata_event, jresp);
+		// NOTE: channel_mutex must never be held while taking mutex
+		g_mutex_lock(&channel_mutex);
+
+		channel = metadata_channel_get(data, request, TRUE, &ret);
+		if (ret < 0) {
+			g_mutex_unlock(&channel_mutex);
+			json_object_put(jmetadata);
+			afb_req_fail(request, "failed", "Invalid subscription options");
+			return;
+		}
+
+		if (channel) {
+			afb_req_subscribe(request, channel->event);
+
+			jresp = metadata_filter(channel, jmetadata);
+			if (!jresp)
+				jresp = json_object_new_object();
+			json_object_object_add(jresp, "event",
+					       json_object_new_string(channel->name));
+			json_object_put(jmetadata);
+		} else {
+			afb_req_subscribe(request, data->metadata_event);
+			jresp = zone_event_reply(data, jmetadata, "metadata", FALSE);
+		}
+
+		g_mutex_unlock(&channel_mutex);
 
-		bluetooth_subscribe(api);
+		afb_req_success(request, jresp, NULL);
+
+		bluetooth_subscribe(afb_req_get_api(request));
 
 		return;
 	} else if (!strcasecmp(value, "playlist")) {
-		json_object *jresp = json_object_new_object();
+		int format = find_playlist_format_idx(afb_req_value(request, "format"));
+		json_object *jresp;
 
-		afb_req_subscribe(request, playlist_event);
-		afb_req_success(request, NULL, NULL);
+		if (format < 0) {
+			afb_req_fail(request, "failed", "invalid format");
+			return;
+		}
 
-		g_mutex_lock(&mutex);
-		jresp = populate_json_playlist(jresp);
-		g_mutex_unlock(&mutex);
+		if (format == PLAYLIST_FORMAT_COMPACT) {
+			afb_req_subscribe(request, data->playlist_compact_event);
+			jresp = zone_event_reply(data, NULL, "playlist.compact", TRUE);
+
+			g_mutex_lock(&mutex);
+			data->playlist_compact_listeners = TRUE;
+			data->playlist_compact_subscribes++;
+			jresp = populate_json_playlist_compact(data, jresp,
+								 data->order);
+			g_mutex_unlock(&mutex);
+		} else {
+			afb_req_subscribe(request, data->playlist_event);
+			jresp = zone_event_reply(data, json_object_new_object(),
+						 "playlist", FALSE);
+
+			g_mutex_lock(&mutex);
+			jresp = populate_json_playlist(data, jresp, data->order);
+			g_mutex_unlock(&mutex);
+		}
 
-		afb_event_push(playlist_event, jresp);
+		afb_req_success(request, jresp, NULL);
 
 		return;
 	}
@@ -758,59 +4596,280 @@ static void subscribe(afb_req_t request)
 static void unsubscribe(afb_req_t request)
 {
 	const char *value = afb_req_value(request, "value");
+	CustomData *data = zone_find(afb_req_value(request, "zone"));
+
+	if (!value) {
+		afb_req_fail(request, "failed", "no value was passed");
+		return;
+	}
+
+	if (!data) {
+		afb_req_fail(request, "failed", "invalid zone");
+		return;
+	}
+
+	if (!strcasecmp(value, "metadata")) {
+		struct metadata_channel *channel;
+		int ret;
+
+		g_mutex_lock(&channel_mutex);
+
+		channel = metadata_channel_get(data, request, FALSE, &ret);
+		if (ret < 0) {
+			g_mutex_unlock(&channel_mutex);
+			afb_req_fail(request, "failed", "Invalid subscription options");
+			return;
+		}
+
+		afb_req_unsubscribe(request, channel ? channel->event :
+				    data->metadata_event);
+
+		g_mutex_unlock(&channel_mutex);
+
+		afb_req_success(request, NULL, NULL);
+		return;
+	} else if (!strcasecmp(value, "playlist")) {
+		int format = find_playlist_format_idx(afb_req_value(request, "format"));
+
+		if (format < 0) {
+			afb_req_fail(request, "failed", "invalid format");
+			return;
+		}
+
+		afb_req_unsubscribe(request, format == PLAYLIST_FORMAT_COMPACT ?
+				    data->playlist_compact_event :
+				    data->playlist_event);
+		afb_req_success(request, NULL, NULL);
+		return;
+	}
+
+	afb_req_fail(request, "failed", "Invalid event");
+}
+
+/*
+ * Album art of the tracks loaded in the zones, so that zones playing the
+ * same track and repeated tag messages don't encode it again. Protected by
+ * mutex.
+ */
+static GHashTable *art_cache = NULL;
+
+static gboolean art_cache_unused(gpointer key, gpointer value, gpointer user_data)
+{
+	int z;
+
+	for (z = 0; z < num_zones; z++) {
+		GList *track = zones[z].current_track;
+
+		if (track && !g_strcmp0(((struct playlist_item *) track->data)->media_path,
+					key))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Tear the pipeline of a zone left paused or stopped for the idle-release
+ * setting down to NULL, which frees its decoders and buffers, and stop its
+ * position timer. The track and position are kept for play to resume from.
+ * Must be called with mutex held.
+ */
+static void idle_release(CustomData *data)
+{
+	GstState state = GST_STATE_NULL;
+
+	gst_element_get_state(data->playbin, &state, NULL, 0);
+
+	// a stopped zone starts the track over, a paused one resumes
+	if (state == GST_STATE_NULL)
+		position_set(data, data->segment.start, NULL, 1.0);
+	else
+		position_sample(data);
+
+	crossfade_finish(data);
+	fade_cancel(data);
+	start_cancel(data);
+	gst_element_set_state(data->playbin, GST_STATE_NULL);
+	AFB_DEBUG("GSTREAMER playbin.state = GST_STATE_NULL");
+
+	data->idle.released = TRUE;
+	data->idle.position_id = 0;
+	stats.idle_releases++;
+}
+
+/*
+ * Track the buffering progress of a stream: a playing zone pauses as soon
+ * as its buffer runs low and plays again once it is refilled. Progress is
+ * pushed on the metadata event in steps of 10 percent. Must be called with
+ * mutex held.
+ */
+static void buffering_update(CustomData *data, int percent)
+{
+	int previous = data->buffering;
+	json_object *jresp;
+
+	data->buffering = percent;
+
+	if (percent < 100 && previous == 100) {
+		stats.rebuffers++;
+
+		// paused, not stopped, whatever WIREPLUMBER_WORKAROUND does
+		if (data->playing && !data->corked) {
+			gst_element_set_state(data->playbin, GST_STATE_PAUSED);
+			AFB_DEBUG("GSTREAMER playbin.state = GST_STATE_PAUSED (buffering)");
+		}
+	} else if (percent == 100 && previous < 100) {
+		if (data->playing && !data->corked) {
+			gst_element_set_state(data->playbin, GST_STATE_PLAYING);
+			AFB_DEBUG("GSTREAMER playbin.state = GST_STATE_PLAYING (buffered)");
+		}
+	}
 
-	if (!strcasecmp(value, "metadata")) {
-		afb_req_unsubscribe(request, metadata_event);
-		afb_req_success(request, NULL, NULL);
+	if (percent / 10 == previous / 10)
 		return;
-	} else if (!strcasecmp(value, "playlist")) {
-		afb_req_unsubscribe(request, playlist_event);
-		afb_req_success(request, NULL, NULL);
-		return;
-	}
 
-	afb_req_fail(request, "failed", "Invalid event");
+	jresp = json_object_new_object();
+	json_object_object_add(jresp, "buffering", json_object_new_int(percent));
+	metadata_push(data, jresp, METADATA_TRACK);
+}
+
+/* a released zone plays again, mutex held */
+static void idle_resumed(CustomData *data)
+{
+	stats.resume_latency = g_get_monotonic_time() - data->idle.resume_start;
+	stats.resume_latency_max = MAX(stats.resume_latency_max,
+				       stats.resume_latency);
+	stats.idle_resumes++;
+	data->idle.resume_start = 0;
 }
 
 static gboolean handle_message(GstBus *bus, GstMessage *msg, CustomData *data)
 {
+	// nothing to do with a pipeline fading out
+	if (bus != data->bus)
+		return TRUE;
+
 	switch (GST_MESSAGE_TYPE (msg)) {
 	case GST_MESSAGE_EOS: {
 		int ret;
 
 		g_mutex_lock(&mutex);
 
-		data->position = GST_CLOCK_TIME_NONE;
+		// rewinding reached the start of the track, resume normal playback
+		if (data->rate < 0) {
+			seek_stream(data, "0", SEEK_CMD);
+			g_mutex_unlock(&mutex);
+			break;
+		}
+
+		history_track_end(data, TRUE);
+		position_set(data, -1, NULL, 1.0);
 		data->duration = GST_CLOCK_TIME_NONE;
 
 		if (data->loop_state == LOOP_TRACK)
-			ret = seek_stream("0", SEEK_CMD);
+			ret = seek_stream(data, "0", SEEK_CMD);
 		else
-			ret = seek_track(NEXT_CMD);
+			ret = seek_track(data, NEXT_CMD);
 
 		if (ret < 0) {
 			int loop_playlist = data->loop_state == LOOP_PLAYLIST;
 
 			if (!loop_playlist) {
-				mediaplayer_set_role_state(data->api, GST_STATE_NULL);
+				mediaplayer_set_role_state(data, GST_STATE_NULL);
 				data->one_time = TRUE;
 			}
 
-			current_track = playlist;
+			data->current_track = playlist_start(data->order);
 
-			if (current_track != NULL)
-				set_media_uri(current_track->data, loop_playlist);
+			if (data->current_track != NULL)
+				set_media_uri(data, data->current_track->data, loop_playlist);
 		}
 
+		state_publish(data);
+		g_mutex_unlock(&mutex);
+		break;
+	}
+	case GST_MESSAGE_ERROR: {
+		GError *error = NULL;
+
+		gst_message_parse_error(msg, &error, NULL);
+
+		g_mutex_lock(&mutex);
+		stats.errors++;
+		track_failed(data, error ? error->message : "unknown error",
+			     error_is_media_fault(data, GST_MESSAGE_SRC(msg), error));
+		state_publish(data);
 		g_mutex_unlock(&mutex);
+
+		g_clear_error(&error);
 		break;
 	}
 	case GST_MESSAGE_DURATION:
 		data->duration = GST_CLOCK_TIME_NONE;
 		break;
+	case GST_MESSAGE_QOS:
+		// the sink dropped a buffer that came too late to be played
+		if (GST_MESSAGE_SRC(msg) == GST_OBJECT(data->audio_sink)) {
+			g_mutex_lock(&mutex);
+			stats.underruns++;
+			g_mutex_unlock(&mutex);
+		}
+		break;
+	case GST_MESSAGE_BUFFERING: {
+		gint percent = 100;
+
+		gst_message_parse_buffering(msg, &percent);
+
+		g_mutex_lock(&mutex);
+		buffering_update(data, percent);
+		g_mutex_unlock(&mutex);
+		break;
+	}
+	case GST_MESSAGE_ASYNC_DONE:
+		g_mutex_lock(&mutex);
+
+		// prerolled for a start at an offset, seek then play
+		if (data->start.position >= 0) {
+			gint64 position = data->start.position;
+
+			data->start.position = -1;
+			if (segment_seek(data, position)) {
+				g_mutex_unlock(&mutex);
+				break;
+			}
+		}
+
+		// a stream still buffering starts once full, see buffering_update()
+		if (data->start.playing && data->buffering < 100) {
+			start_cancel(data);
+			data->playing = TRUE;
+			state_publish(data);
+		} else if (data->start.playing) {
+			mediaplayer_set_role_state(data, GST_STATE_PLAYING);
+			AFB_DEBUG("GSTREAMER playbin.state = GST_STATE_PLAYING");
+			state_publish(data);
+		}
+
+		position_sample(data);
+		g_mutex_unlock(&mutex);
+		break;
+	case GST_MESSAGE_STATE_CHANGED:
+		g_mutex_lock(&mutex);
+		if (GST_MESSAGE_SRC(msg) == GST_OBJECT(data->playbin)) {
+			GstState state = GST_STATE_NULL;
+
+			gst_message_parse_state_changed(msg, NULL, &state, NULL);
+			if (state == GST_STATE_PLAYING && data->idle.resume_start)
+				idle_resumed(data);
+
+			position_sample(data);
+			state_publish(data);
+		}
+		g_mutex_unlock(&mutex);
+		break;
 	case GST_MESSAGE_TAG: {
 		GstTagList *tags = NULL;
-		gchar *image = NULL;
+		gchar *image = NULL, *path = NULL;
 		json_object *jresp, *jobj;
 
 		// TODO: This will get triggered multipl times due to gstreamer
@@ -821,7 +4880,37 @@ static gboolean handle_message(GstBus *bus, GstMessage *msg, CustomData *data)
 		if (!tags)
 			break;
 
-		image = get_album_art(tags);
+		g_mutex_lock(&mutex);
+
+		if (data->current_track) {
+			struct playlist_item *item = data->current_track->data;
+			gdouble gain, cached;
+
+			// no need to analyze streams carrying ReplayGain tags
+			if (data->normalize &&
+			    gst_tag_list_get_double(tags, GST_TAG_TRACK_GAIN, &gain) &&
+			    !loudness_lookup(playlist_item_uri(item), &cached))
+				loudness_store(playlist_item_uri(item), gain);
+
+			path = g_strdup(item->media_path);
+			image = g_strdup(g_hash_table_lookup(art_cache, path));
+		}
+
+		g_mutex_unlock(&mutex);
+
+		if (!image) {
+			image = get_album_art(tags);
+
+			if (image && path) {
+				g_mutex_lock(&mutex);
+				g_hash_table_foreach_remove(art_cache, art_cache_unused, NULL);
+				g_hash_table_replace(art_cache, path, g_strdup(image));
+				g_mutex_unlock(&mutex);
+				path = NULL;
+			}
+		}
+
+		g_free(path);
 
 		jobj = json_object_new_object();
 		json_object_object_add(jobj, "image",
@@ -832,7 +4921,7 @@ static gboolean handle_message(GstBus *bus, GstMessage *msg, CustomData *data)
 		jresp = json_object_new_object();
 		json_object_object_add(jresp, "track", jobj);
 
-		afb_event_push(metadata_event, jresp);
+		metadata_push(data, jresp, METADATA_ART);
 
 		gst_tag_list_unref(tags);
 
@@ -846,16 +4935,18 @@ static gboolean handle_message(GstBus *bus, GstMessage *msg, CustomData *data)
 		g_mutex_lock(&mutex);
 
 		if (state == GST_STATE_PAUSED) {
+			crossfade_finish(data);
 			data->corked = TRUE;
 			// NOTE: Explicitly using PAUSED here, this case currently
 			//       is separate from the general PAUSED/READY issue wrt
 			//       Wireplumber policy.
-			gst_element_set_state(data->playbin, GST_STATE_PAUSED);
+			fade_out(data, GST_STATE_PAUSED);
 		} else if (state == GST_STATE_PLAYING) {
 			data->corked = FALSE;
-			gst_element_set_state(data->playbin, GST_STATE_PLAYING);
+			fade_in(data);
 		}
 
+		state_publish(data);
 		g_mutex_unlock(&mutex);
 
 		break;
@@ -871,6 +4962,7 @@ static gboolean position_event(CustomData *data)
 {
 	struct playlist_item *track;
 	json_object *jresp = NULL, *metadata;
+	gint64 position, duration;
 
 	g_mutex_lock(&mutex);
 
@@ -882,90 +4974,322 @@ static gboolean position_event(CustomData *data)
 				       json_object_new_string("stopped"));
 		g_mutex_unlock(&mutex);
 
-		afb_event_push(metadata_event, jresp);
+		metadata_push(data, jresp, METADATA_TRACK);
 		return TRUE;
 	}
 
-	if (!data->playing || current_track == NULL) {
+	if (!data->playing || data->current_track == NULL) {
+		gint64 now = g_get_monotonic_time();
+
+		if (settings.idle_release > 0 && !data->outgoing.playbin &&
+		    now - data->idle.since >= settings.idle_release * G_USEC_PER_SEC) {
+			idle_release(data);
+			g_mutex_unlock(&mutex);
+			return G_SOURCE_REMOVE;
+		}
+
 		g_mutex_unlock(&mutex);
 		return TRUE;
 	}
 
-	track = current_track->data;
-	metadata = populate_json(track);
-	jresp = json_object_new_object();
+	data->idle.since = g_get_monotonic_time();
 
-	if (!GST_CLOCK_TIME_IS_VALID(data->duration))
-		gst_element_query_duration(data->playbin,
-					GST_FORMAT_TIME, &data->duration);
+	if (stall_check(data)) {
+		state_publish(data);
+		g_mutex_unlock(&mutex);
+		return TRUE;
+	}
+
+	track = data->current_track->data;
+	duration = track_duration(data);
+	position = position_get(data);
 
-	gst_element_query_position(data->playbin,
-					GST_FORMAT_TIME, &data->position);
+	metadata = populate_json_selected(data, track);
+	jresp = json_object_new_object();
 
-	json_object_object_add(metadata, "duration",
-			       json_object_new_int64(data->duration / GST_MSECOND));
-	json_object_object_add(jresp, "position",
-			       json_object_new_int64(data->position / GST_MSECOND));
+	if (position >= 0)
+		json_object_object_add(jresp, "position",
+				       json_object_new_int64(position / GST_MSECOND));
 	json_object_object_add(jresp, "status",
 			       json_object_new_string("playing"));
 
-	if (metadata_track != current_track)
-		metadata_track = current_track;
+	if (data->rate != 1.0)
+		json_object_object_add(jresp, "rate",
+				       json_object_new_double(data->rate));
 
 	json_object_object_add(jresp, "track", metadata);
 
+	seek_index_sample(data);
+
+	// start fading into the next track ahead of the end of this one
+	if (data->crossfade > 0 && !data->outgoing.playbin && data->rate == 1.0 &&
+	    data->loop_state != LOOP_TRACK && duration >= 0 && position >= 0) {
+		gint64 remaining = (duration - position) / (gint64) GST_MSECOND;
+		GList *next = playlist_step_playable(data->order,
+						     data->current_track, TRUE);
+
+		if (!next && data->loop_state == LOOP_PLAYLIST)
+			next = playlist_start(data->order);
+
+		// chapters of the same file follow each other without a fade
+		if (next && playlist_item_same_file(track, next->data))
+			next = NULL;
+
+		if (next && remaining <= data->crossfade &&
+		    remaining > CROSSFADE_MIN_MS &&
+		    data->outgoing.failed != data->current_track) {
+			GList *ending = data->current_track;
+
+			// played once the next track took over, else left to EOS
+			crossfade_start(data, next, remaining);
+			if (data->current_track != ending)
+				history_log(track, TRUE);
+			else
+				data->outgoing.failed = ending;
+		}
+	}
+
+	state_publish(data);
 	g_mutex_unlock(&mutex);
 
-        afb_event_push(metadata_event, jresp);
+	metadata_push(data, jresp, METADATA_POSITION);
 
 	return TRUE;
 }
 
-static void gstreamer_init(afb_api_t api)
+/* scheduling of a class of threads from @jpolicy, @name telling them in logs */
+static void thread_policy_parse(json_object *jpolicy, struct thread_policy *tp,
+				const char *name)
 {
-	GstBus *bus;
-	json_object *response;
-	int ret;
+	json_object *val = NULL;
 
-	gst_init(NULL, NULL);
+	if (json_object_object_get_ex(jpolicy, "policy", &val)) {
+		const char *policy = json_object_get_string(val);
 
-	data.api = api;
-	data.playbin = gst_element_factory_make("playbin", "playbin");
-	if (!data.playbin) {
-		AFB_ERROR("GST Pipeline: Failed to create 'playbin' element!");
-		exit(1);
+		if (!g_strcmp0(policy, "fifo"))
+			tp->policy = SCHED_FIFO;
+		else if (!g_strcmp0(policy, "rr"))
+			tp->policy = SCHED_RR;
+		else if (!g_strcmp0(policy, "other"))
+			tp->policy = SCHED_OTHER;
+		else
+			AFB_WARNING("Ignoring unknown %s thread policy '%s'",
+				    name, policy);
 	}
 
-	data.fake_sink = gst_element_factory_make("fakesink", NULL);
-	if (!data.fake_sink)
-	{
-		AFB_ERROR("GST Pipeline: Failed to create 'fakesink' element!");
-		exit(1);
+	if (json_object_object_get_ex(jpolicy, "priority", &val))
+		tp->priority = CLAMP(json_object_get_int(val),
+				     sched_get_priority_min(SCHED_FIFO),
+				     sched_get_priority_max(SCHED_FIFO));
+
+	if (tp->policy == SCHED_OTHER)
+		tp->priority = 0;
+
+	if (json_object_object_get_ex(jpolicy, "nice", &val)) {
+		tp->nice = CLAMP(json_object_get_int(val), -20, 19);
+		tp->set_nice = TRUE;
+	}
+
+	if (json_object_object_get_ex(jpolicy, "cpus", &val) &&
+	    json_object_is_type(val, json_type_array)) {
+		int i;
+
+		CPU_ZERO(&tp->cpus);
+		for (i = 0; i < json_object_array_length(val); i++) {
+			int cpu = json_object_get_int(json_object_array_get_idx(val, i));
+
+			if (cpu >= 0 && cpu < CPU_SETSIZE)
+				CPU_SET(cpu, &tp->cpus);
+		}
+
+		tp->set_cpus = CPU_COUNT(&tp->cpus) > 0;
+	}
+}
+
+static void settings_init(afb_api_t api)
+{
+	json_object *jsettings = afb_api_settings(api);
+	json_object *val = NULL;
+
+	if (json_object_object_get_ex(jsettings, "discovery-workers", &val))
+		settings.discovery_workers = CLAMP(json_object_get_int(val), 0,
+						   DISCOVERY_MAX_WORKERS);
+
+	if (json_object_object_get_ex(jsettings, "normalize", &val))
+		settings.normalize = json_object_get_boolean(val);
+
+	if (json_object_object_get_ex(jsettings, "crossfade", &val))
+		settings.crossfade = MAX(json_object_get_int64(val), 0);
+
+	if (json_object_object_get_ex(jsettings, "ingest-window", &val))
+		settings.ingest_window = MAX(json_object_get_int64(val), 0);
+
+	if (json_object_object_get_ex(jsettings, "idle-release", &val))
+		settings.idle_release = MAX(json_object_get_int64(val), 0);
+
+	if (json_object_object_get_ex(jsettings, "buffer-size", &val))
+		settings.buffer_size = MAX(json_object_get_int(val), 0);
+
+	if (json_object_object_get_ex(jsettings, "buffer-duration", &val))
+		settings.buffer_duration = MAX(json_object_get_int64(val), 0);
+
+	if (json_object_object_get_ex(jsettings, "buffer-low-watermark", &val))
+		settings.buffer_low_watermark = CLAMP(json_object_get_int(val), 0, 100);
+
+	if (json_object_object_get_ex(jsettings, "buffer-high-watermark", &val))
+		settings.buffer_high_watermark = CLAMP(json_object_get_int(val),
+						       settings.buffer_low_watermark, 100);
+
+	if (json_object_object_get_ex(jsettings, "loop-thread", &val))
+		thread_policy_parse(val, &settings.loop_thread, "bus loop");
+
+	if (json_object_object_get_ex(jsettings, "streaming-threads", &val))
+		thread_policy_parse(val, &settings.streaming_threads, "streaming");
+
+	if (json_object_object_get_ex(jsettings, "sink-profile", &val)) {
+		int profile = find_sink_profile_idx(json_object_get_string(val));
+
+		if (profile >= 0)
+			settings.sink_profile = profile;
+		else
+			AFB_WARNING("Ignoring unknown sink profile '%s'",
+				    json_object_get_string(val));
+	}
+
+	if (json_object_object_get_ex(jsettings, "zones", &val) &&
+	    json_object_is_type(val, json_type_array)) {
+		int i, n = 0;
+
+		for (i = 0; i < json_object_array_length(val) && n < ZONES_MAX; i++) {
+			json_object *jzone = json_object_array_get_idx(val, i);
+			json_object *jname = NULL, *jrole = NULL;
+			const char *name;
+			int j;
+
+			if (!json_object_object_get_ex(jzone, "name", &jname)) {
+				AFB_WARNING("Ignoring zone without a name");
+				continue;
+			}
+
+			name = json_object_get_string(jname);
+			for (j = 0; j < n; j++) {
+				if (!g_strcmp0(settings.zones[j].name, name))
+					break;
+			}
+			if (j < n) {
+				AFB_WARNING("Ignoring duplicate zone '%s'", name);
+				continue;
+			}
+
+			json_object_object_get_ex(jzone, "role", &jrole);
+
+			settings.zones[n].name = g_strdup(name);
+			settings.zones[n].role = g_strdup(jrole ?
+					json_object_get_string(jrole) : "Multimedia");
+			n++;
+		}
+
+		if (n > 0)
+			settings.num_zones = n;
+	}
+}
+
+static afb_event_t zone_make_event(CustomData *data, const char *name)
+{
+	gchar *event = zone_event_name(data, name);
+	afb_event_t ret = afb_daemon_make_event(event);
+
+	g_free(event);
+
+	return ret;
+}
+
+static int zone_init(CustomData *data, afb_api_t api)
+{
+	data->api = api;
+	data->volume = 50;
+	data->corked = FALSE;
+	data->position.stream_time = -1;
+	data->start.position = -1;
+	data->segment.stop = -1;
+	data->recovery.checked = -1;
+	data->index.entries = g_array_new(FALSE, FALSE, sizeof(struct seek_entry));
+	data->duration = GST_CLOCK_TIME_NONE;
+	data->rate = 1.0;
+	data->buffering = 100;
+	data->normalize = settings.normalize;
+	data->crossfade = settings.crossfade;
+	data->profile = settings.sink_profile;
+
+	data->metadata_event = zone_make_event(data, "metadata");
+	data->playlist_event = zone_make_event(data, "playlist");
+	data->playlist_compact_event = zone_make_event(data, "playlist.compact");
+
+	if (pipeline_create(data) < 0)
+		return -ENOMEM;
+
+	if (!data->fader)
+		AFB_WARNING("GST Pipeline: 'volume' element unavailable, "
+			    "volume changes will not be ramped in zone %s",
+			    data->name);
+
+	if (!data->rgvolume) {
+		AFB_WARNING("GST Pipeline: ReplayGain elements unavailable, "
+			    "normalization disabled in zone %s", data->name);
+		data->normalize = FALSE;
 	}
 
-	data.audio_sink = gst_element_factory_make("pipewiresink", NULL);
-	if (!data.audio_sink)
+	data->fake_sink = gst_element_factory_make("fakesink", NULL);
+	if (!data->fake_sink)
 	{
-		AFB_ERROR("GST Pipeline: Failed to create 'pipewiresink' element!");
-		exit(1);
+		AFB_ERROR("GST Pipeline: Failed to create 'fakesink' element!");
+		return -ENOMEM;
 	}
-	gst_util_set_object_arg(G_OBJECT(data.audio_sink),
-				"stream-properties", "p,media.role=Multimedia");
+	gst_object_ref_sink(data->fake_sink);
 
-	g_object_set(data.playbin, "audio-sink", data.fake_sink, NULL);
+	g_object_set(data->playbin, "audio-sink", data->fake_sink, NULL);
 	AFB_DEBUG("GSTREAMER playbin.audio-sink = fake-sink");
 
 #ifdef WIREPLUMBER_WORKAROUND
-	gst_element_set_state(data.playbin, GST_STATE_READY);
+	gst_element_set_state(data->playbin, GST_STATE_READY);
 	AFB_DEBUG("GSTREAMER playbin.state = GST_STATE_READY");
 #else
-	gst_element_set_state(data.playbin, GST_STATE_PAUSED);
+	gst_element_set_state(data->playbin, GST_STATE_PAUSED);
 	AFB_DEBUG("GSTREAMER playbin.state = GST_STATE_PAUSED");
 #endif
 
-	bus = gst_element_get_bus(data.playbin);
-	gst_bus_add_watch(bus, (GstBusFunc) handle_message, &data);
-	g_timeout_add_seconds(1, (GSourceFunc) position_event, &data);
+	state_publish(data);
+	idle_wake(data);
+
+	AFB_INFO("Zone %s plays with role %s", data->name, data->role);
+
+	return 0;
+}
+
+static void gstreamer_init(afb_api_t api)
+{
+	json_object *response;
+	int ret, z;
+
+	gst_init(NULL, NULL);
+
+	playlist_paths = g_hash_table_new(g_str_hash, g_str_equal);
+	library = library_new();
+	art_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	discovery_init();
+	loudness_init();
+	seek_index_cache = media_cache_load(SEEK_INDEX_CACHE);
+	bad_cache = media_cache_load(BAD_CACHE);
+	history = history_load(HISTORY_LOG);
+
+	num_zones = settings.num_zones;
+	for (z = 0; z < num_zones; z++) {
+		zones[z].name = settings.zones[z].name;
+		zones[z].role = settings.zones[z].role;
+
+		if (zone_init(&zones[z], api) < 0)
+			exit(1);
+	}
 
 	ret = afb_api_call_sync(api, "mediascanner", "media_result", NULL, &response, NULL, NULL);
 	if (!ret) {
@@ -980,24 +5304,115 @@ static void gstreamer_init(afb_api_t api)
 	json_object_put(response);
 }
 
+/* push the playlist and metadata of every zone after the media changed */
+static void media_changed(void)
+{
+	json_object *jresp[ZONES_MAX];
+	int z;
+
+	playlist_push();
+
+	// send metadata out after event
+	g_mutex_lock(&mutex);
+	for (z = 0; z < num_zones; z++) {
+		jresp[z] = populate_json_metadata(&zones[z]);
+		state_publish(&zones[z]);
+	}
+	g_mutex_unlock(&mutex);
+
+	for (z = 0; z < num_zones; z++) {
+		if (jresp[z])
+			metadata_push(&zones[z], jresp[z], METADATA_TRACK);
+	}
+}
+
+/*
+ * Media added by mediascanner arrives in bursts of events when a device is
+ * mounted. They are queued for the ingest window and added to the playlist
+ * in a single pass, followed by a single playlist update. Protected by mutex.
+ */
+static struct {
+	json_object *pending;
+	guint timeout_id;
+} ingest;
+
+/* add the queued media to the playlist, must be called with mutex held */
+static gboolean ingest_run(void)
+{
+	if (ingest.timeout_id) {
+		g_source_remove(ingest.timeout_id);
+		ingest.timeout_id = 0;
+	}
+
+	if (!ingest.pending)
+		return FALSE;
+
+	populate_playlist(ingest.pending);
+	json_object_put(ingest.pending);
+	ingest.pending = NULL;
+	stats.ingest_passes++;
+
+	return TRUE;
+}
+
+static gboolean ingest_flush(gpointer user_data)
+{
+	gboolean changed;
+
+	g_mutex_lock(&mutex);
+	ingest.timeout_id = 0;
+	changed = ingest_run();
+	g_mutex_unlock(&mutex);
+
+	if (changed)
+		media_changed();
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Must be called with mutex held */
+static void ingest_queue(json_object *jmedia)
+{
+	int i;
+
+	if (!json_object_is_type(jmedia, json_type_array))
+		return;
+
+	if (!ingest.pending)
+		ingest.pending = json_object_new_array();
+
+	for (i = 0; i < json_object_array_length(jmedia); i++)
+		json_object_array_add(ingest.pending,
+			json_object_get(json_object_array_get_idx(jmedia, i)));
+
+	stats.ingest_events++;
+
+	if (!ingest.timeout_id)
+		ingest.timeout_id = g_timeout_add(settings.ingest_window,
+						  ingest_flush, NULL);
+}
+
 static void onevent(afb_api_t api, const char *event, struct json_object *object)
 {
-	json_object *jresp = NULL;
+	// Bluetooth and steering wheel controls act on the first zone
+	CustomData *data = &zones[0];
+	int z;
 
 	if (!g_strcmp0(event, "mediascanner/media_added")) {
 		json_object *val = NULL;
-		gboolean ret;
 
-		g_mutex_lock(&mutex);
+		if (!json_object_object_get_ex(object, "Media", &val))
+			return;
 
-		ret = json_object_object_get_ex(object, "Media", &val);
-		if (ret)
-			populate_playlist(val);
+		g_mutex_lock(&mutex);
+		ingest_queue(val);
+		g_mutex_unlock(&mutex);
 
+		return;
 	} else if (!g_strcmp0(event, "mediascanner/media_removed")) {
 		json_object *val = NULL;
 		const char *path;
-		GList *l = playlist;
+		GList *l;
 		gboolean ret;
 
 		ret = json_object_object_get_ex(object, "Path", &val);
@@ -1008,26 +5423,42 @@ static void onevent(afb_api_t api, const char *event, struct json_object *object
 
 		g_mutex_lock(&mutex);
 
+		// media added earlier must be there to be removed
+		ingest_run();
+		l = playlist;
+
 		while (l) {
 			struct playlist_item *item = l->data;
+			GList *link = l;
 
 			l = l->next;
 
 			if (!strncasecmp(path, item->media_path, strlen(path))) {
-				if (current_track && current_track->data == item) {
-					current_track = NULL;
-					data.one_time = TRUE;
-					mediaplayer_set_role_state(api, GST_STATE_NULL);
+				for (z = 0; z < num_zones; z++) {
+					CustomData *zone = &zones[z];
+
+					if (!zone->current_track ||
+					    zone->current_track->data != item)
+						continue;
+
+					crossfade_finish(zone);
+					zone->current_track = NULL;
+					zone->one_time = TRUE;
+					mediaplayer_set_role_state(zone, GST_STATE_NULL);
 					AFB_DEBUG("GSTREAMER playbin.state = GST_STATE_NULL");
 				}
 
-				playlist = g_list_remove(playlist, item);
+				g_hash_table_remove(playlist_paths, item->media_path);
+				library_remove(library, item);
+				playlist_unlink(link);
 				g_free_playlist_item(item);
 			}
 		}
 
-		if (current_track == NULL)
-			current_track = g_list_first(playlist);
+		for (z = 0; z < num_zones; z++) {
+			if (zones[z].current_track == NULL)
+				zones[z].current_track = playlist_start(zones[z].order);
+		}
 	} else if (!g_ascii_strcasecmp(event, "Bluetooth-Manager/media")) {
 		json_object *val;
 
@@ -1035,32 +5466,35 @@ static void onevent(afb_api_t api, const char *event, struct json_object *object
 
 		if (json_object_object_get_ex(object, "connected", &val)) {
 			gboolean state = json_object_get_boolean(val);
-			data.avrcp_connected = state;
+			data->avrcp_connected = state;
 
 			if (state) {
+				crossfade_finish(data);
 #ifdef WIREPLUMBER_WORKAROUND
-				mediaplayer_set_role_state(api, GST_STATE_READY);
+				mediaplayer_set_role_state(data, GST_STATE_READY);
 #else
-				mediaplayer_set_role_state(api, GST_STATE_PAUSED);
+				mediaplayer_set_role_state(data, GST_STATE_PAUSED);
 #endif
 				// Local media playback cannot be corked at this point if it's stopped
-				data.corked = FALSE;
+				data->corked = FALSE;
 			} else {
-				json_object *jresp = populate_json_metadata();
+				json_object *jresp = populate_json_metadata(data);
 
 				if (!jresp)
 					jresp = json_object_new_object();
 
 				json_object_object_add(jresp, "status",
 				       json_object_new_string("stopped"));
-				afb_event_push(metadata_event, jresp);
+				metadata_push(data, jresp, METADATA_TRACK);
 			}
+
+			state_publish(data);
 		}
 
 		g_mutex_unlock(&mutex);
 
 		json_object_get(object);
-		afb_event_push(metadata_event, object);
+		metadata_push(data, object, METADATA_BLUETOOTH);
 
 		return;
 	} else if (g_str_has_prefix(event, "signal-composer/")) {
@@ -1078,7 +5512,7 @@ static void onevent(afb_api_t api, const char *event, struct json_object *object
 			return;
 
 		g_mutex_lock(&mutex);
-		corked = data.corked;
+		corked = data->corked;
 		g_mutex_unlock(&mutex);
 
 		// drop events if we are in corked state
@@ -1094,32 +5528,36 @@ static void onevent(afb_api_t api, const char *event, struct json_object *object
 			return;
 
 		if (!strcmp(uid, "event.media.next")) {
-			if(data.playing) {
+			if(data->playing) {
 				g_mutex_lock(&mutex);
-				if (!data.avrcp_connected)
-					seek_track(NEXT_CMD);
-				else
+				if (!data->avrcp_connected) {
+					seek_track(data, NEXT_CMD);
+					state_publish(data);
+				} else {
 					avrcp_cmd(api, "Next");
+				}
 				g_mutex_unlock(&mutex);
 
 				json_object_get(object);
-				afb_event_push(metadata_event, object);
+				metadata_push(data, object, METADATA_SIGNAL);
 			}
 		} else if (!strcmp(uid, "event.media.previous")) {
-			if(data.playing) {
+			if(data->playing) {
 				g_mutex_lock(&mutex);
-				if (!data.avrcp_connected)
-					seek_track(PREVIOUS_CMD);
-				else
+				if (!data->avrcp_connected) {
+					seek_track(data, PREVIOUS_CMD);
+					state_publish(data);
+				} else {
 					avrcp_cmd(api, "Previous");
+				}
 				g_mutex_unlock(&mutex);
 
 				json_object_get(object);
-				afb_event_push(metadata_event, object);
+				metadata_push(data, object, METADATA_SIGNAL);
 			}
 		} else if (!strcmp(uid, "event.media.mode")) {
 			g_mutex_lock(&mutex);
-			avrcp_cmd(api, data.avrcp_connected ? "disconnect" : "connect");
+			avrcp_cmd(api, data->avrcp_connected ? "disconnect" : "connect");
 			g_mutex_unlock(&mutex);
 		} else {
 			AFB_WARNING("Unhandled signal-composer uid '%s'", uid);
@@ -1132,24 +5570,15 @@ static void onevent(afb_api_t api, const char *event, struct json_object *object
 
 	// Fall through for mediascanner events
 
-	jresp = json_object_new_object();
-	jresp = populate_json_playlist(jresp);
-
-	g_mutex_unlock(&mutex);
-
-        afb_event_push(playlist_event, jresp);
-
-	// send metadata out after event
-	g_mutex_lock(&mutex);
-	jresp = populate_json_metadata();
 	g_mutex_unlock(&mutex);
 
-	if (jresp)
-		afb_event_push(metadata_event, jresp);
+	media_changed();
 }
 
 void *gstreamer_loop_thread(void *ptr)
 {
+	thread_policy_apply(&settings.loop_thread, "bus loop");
+
 	g_main_loop_run(g_main_loop_new(NULL, FALSE));
 
 	return NULL;
@@ -1209,19 +5638,151 @@ static int init(afb_api_t api)
 		}
 	}
 
-	metadata_event = afb_daemon_make_event("metadata");
-	playlist_event = afb_daemon_make_event("playlist");
-
+	settings_init(api);
 	gstreamer_init(api);
 
 	return pthread_create(&thread_id, NULL, gstreamer_loop_thread, NULL);
 }
 
+static void state(afb_req_t request)
+{
+	CustomData *data = zone_find(afb_req_value(request, "zone"));
+	struct state_snapshot *snap;
+	json_object *jresp;
+	gint64 position;
+
+	if (!data) {
+		afb_req_fail(request, "failed", "invalid zone");
+		return;
+	}
+
+	snap = state_snapshot_get(data);
+	if (!snap) {
+		afb_req_fail(request, "failed", "not ready");
+		return;
+	}
+
+	jresp = json_object_new_object();
+	json_object_object_add(jresp, "zone", json_object_new_string(data->name));
+	json_object_object_add(jresp, "playing",
+			       json_object_new_boolean(snap->playing));
+	json_object_object_add(jresp, "corked",
+			       json_object_new_boolean(snap->corked));
+	json_object_object_add(jresp, "loop",
+			       json_object_new_string(LOOP_STATES[snap->loop_state]));
+	json_object_object_add(jresp, "order",
+			       json_object_new_string(library_orders[snap->order]));
+	json_object_object_add(jresp, "volume",
+			       json_object_new_int64(snap->volume));
+	json_object_object_add(jresp, "rate", json_object_new_double(snap->rate));
+	json_object_object_add(jresp, "normalize",
+			       json_object_new_boolean(snap->normalize));
+	json_object_object_add(jresp, "crossfade",
+			       json_object_new_int64(snap->crossfade));
+	json_object_object_add(jresp, "bluetooth",
+			       json_object_new_boolean(snap->avrcp_connected));
+
+	position = position_get(data);
+	if (position >= 0)
+		json_object_object_add(jresp, "position",
+				       json_object_new_int64(position / GST_MSECOND));
+
+	// the tree is shared by readers, whose copies leave its refcounts alone
+	if (snap->track) {
+		json_object *jtrack = NULL;
+
+		if (!json_object_deep_copy(snap->track, &jtrack, NULL))
+			json_object_object_add(jresp, "track", jtrack);
+	}
+
+	state_snapshot_unref(snap);
+
+	afb_req_success(request, jresp, NULL);
+}
+
+static void metrics(afb_req_t request)
+{
+	json_object *jresp = json_object_new_object();
+	json_object *jcrossfade = json_object_new_object();
+	json_object *jingest = json_object_new_object();
+	json_object *jidle = json_object_new_object();
+	json_object *joutput = json_object_new_object();
+	json_object *jrecovery = json_object_new_object();
+	int z;
+
+	g_mutex_lock(&mutex);
+
+	json_object_object_add(jresp, "underruns",
+			       json_object_new_int(stats.underruns));
+	json_object_object_add(jresp, "rebuffers",
+			       json_object_new_int(stats.rebuffers));
+
+	json_object_object_add(jrecovery, "errors",
+			       json_object_new_int(stats.errors));
+	json_object_object_add(jrecovery, "stalls",
+			       json_object_new_int(stats.stalls));
+	json_object_object_add(jrecovery, "skips",
+			       json_object_new_int(stats.skips));
+
+	for (z = 0; z < num_zones; z++) {
+		CustomData *data = &zones[z];
+		json_object *jzone = json_object_new_object();
+		gint64 latency = sink_latency(data);
+
+		json_object_object_add(jzone, "profile",
+				json_object_new_string(SINK_PROFILES[data->profile].name));
+		if (latency >= 0)
+			json_object_object_add(jzone, "latency-ms",
+				       json_object_new_int64(latency / GST_MSECOND));
+
+		json_object_object_add(joutput, data->name, jzone);
+	}
+
+	json_object_object_add(jidle, "releases",
+			       json_object_new_int(stats.idle_releases));
+	json_object_object_add(jidle, "resumes",
+			       json_object_new_int(stats.idle_resumes));
+	json_object_object_add(jidle, "resume-ms",
+			       json_object_new_int64(stats.resume_latency / 1000));
+	json_object_object_add(jidle, "max-resume-ms",
+			       json_object_new_int64(stats.resume_latency_max / 1000));
+
+	json_object_object_add(jingest, "events",
+			       json_object_new_int(stats.ingest_events));
+	json_object_object_add(jingest, "passes",
+			       json_object_new_int(stats.ingest_passes));
+	json_object_object_add(jingest, "merged",
+			       json_object_new_int(stats.ingest_events -
+						   stats.ingest_passes));
+
+	json_object_object_add(jcrossfade, "count",
+			       json_object_new_int(stats.crossfades));
+	json_object_object_add(jcrossfade, "cpu-ms",
+			       json_object_new_int64(stats.crossfade_cpu));
+	json_object_object_add(jcrossfade, "total-cpu-ms",
+			       json_object_new_int64(stats.crossfade_cpu_total));
+
+	g_mutex_unlock(&mutex);
+
+	json_object_object_add(jresp, "crossfade", jcrossfade);
+	json_object_object_add(jresp, "ingest", jingest);
+	json_object_object_add(jresp, "idle", jidle);
+	json_object_object_add(jresp, "output", joutput);
+	json_object_object_add(jresp, "recovery", jrecovery);
+
+	afb_req_success(request, jresp, NULL);
+}
+
 static const afb_verb_t binding_verbs[] = {
 	{ .verb = "playlist",     .callback = audio_playlist, .info = "Get/set playlist" },
 	{ .verb = "controls",     .callback = controls,       .info = "Audio controls" },
 	{ .verb = "subscribe",    .callback = subscribe,      .info = "Subscribe to GStreamer events" },
 	{ .verb = "unsubscribe",  .callback = unsubscribe,    .info = "Unsubscribe to GStreamer events" },
+	{ .verb = "search",       .callback = search,         .info = "Search media in the playlist" },
+	{ .verb = "browse",       .callback = browse,         .info = "Browse media by artist and album" },
+	{ .verb = "history",      .callback = audio_history,  .info = "Get recently and most played media" },
+	{ .verb = "state",        .callback = state,          .info = "Get playback state" },
+	{ .verb = "metrics",      .callback = metrics,        .info = "Get playback metrics" },
 	{ }
 };
 
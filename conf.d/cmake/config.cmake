@@ -69,6 +69,8 @@ set (PKG_REQUIRED_LIST
 	json-c
 	gstreamer-1.0
 	gstreamer-tag-1.0
+	gstreamer-pbutils-1.0
+	gstreamer-controller-1.0
 	glib-2.0
 	gio-2.0
 	gobject-2.0
@@ -19,22 +19,85 @@
 
 
 _AFT.testVerbStatusSuccess('testPlaylistSuccess','mediaplayer','playlist', {})
+_AFT.testVerbStatusSuccess('testPlaylistCompactSuccess','mediaplayer','playlist', {format="compact"})
+_AFT.testVerbStatusError('testPlaylistFormatError','mediaplayer','playlist', {format="invalid"})
+_AFT.testVerbStatusSuccess('testPlaylistZoneSuccess','mediaplayer','playlist', {zone="default"})
+_AFT.testVerbStatusError('testPlaylistZoneError','mediaplayer','playlist', {zone="invalid"})
+_AFT.testVerbStatusSuccess('testPlaylistSortSuccess','mediaplayer','playlist', {sort="artist"})
+_AFT.testVerbStatusSuccess('testPlaylistCompactSortSuccess','mediaplayer','playlist', {format="compact", sort="added"})
+_AFT.testVerbStatusError('testPlaylistSortError','mediaplayer','playlist', {sort="invalid"})
 
 _AFT.testVerbStatusSuccess('testControlsPlaySuccess','mediaplayer','controls', {value="play"})
 _AFT.testVerbStatusSuccess('testControlsPauseSuccess','mediaplayer','controls', {value="pause"})
+_AFT.testVerbStatusSuccess('testControlsResumeSuccess','mediaplayer','controls', {value="play"})
+_AFT.testVerbStatusSuccess('testControlsVolumeRampSuccess','mediaplayer','controls', {value="volume", volume=50})
+_AFT.testVerbStatusError('testControlsZoneError','mediaplayer','controls', {value="volume", volume=50, zone="invalid"})
 _AFT.testVerbStatusSuccess('testControlsPreviousSuccess','mediaplayer','controls', {value="previous"})
 _AFT.testVerbStatusSuccess('testControlsNextSuccess','mediaplayer','controls', {value="next"})
 _AFT.testVerbStatusSuccess('testControlsSeekSuccess','mediaplayer','controls', {value="seek", position=10000})
 _AFT.testVerbStatusSuccess('testControlsFastForwardSuccess','mediaplayer','controls', {value="fast-forward", position=10000})
 _AFT.testVerbStatusSuccess('testControlsRewindSuccess','mediaplayer','controls', {value="rewind", position=10000})
+_AFT.testVerbStatusSuccess('testControlsFastForwardRateSuccess','mediaplayer','controls', {value="fast-forward", rate=2})
+_AFT.testVerbStatusSuccess('testControlsFastForwardRateResetSuccess','mediaplayer','controls', {value="fast-forward", rate=1})
+_AFT.testVerbStatusError('testControlsFastForwardRateError','mediaplayer','controls', {value="fast-forward", rate=0})
 _AFT.testVerbStatusSuccess('testControlsPickTrackSuccess','mediaplayer','controls', {value="pick-track", index=1})
 _AFT.testVerbStatusSuccess('testControlsVolumeSuccess','mediaplayer','controls', {value="volume", volume=10})
 _AFT.testVerbStatusSuccess('testControlsLoopEnableSuccess','mediaplayer','controls', {value="loop", state="on"})
 _AFT.testVerbStatusSuccess('testControlsLoopDisableSuccess','mediaplayer','controls', {value="loop", state="off"})
+_AFT.testVerbStatusSuccess('testControlsNormalizeEnableSuccess','mediaplayer','controls', {value="normalize", state="on"})
+_AFT.testVerbStatusSuccess('testControlsNormalizeDisableSuccess','mediaplayer','controls', {value="normalize", state="off"})
+_AFT.testVerbStatusSuccess('testControlsCrossfadeEnableSuccess','mediaplayer','controls', {value="crossfade", duration=3000})
+_AFT.testVerbStatusSuccess('testControlsCrossfadeNextSuccess','mediaplayer','controls', {value="next"})
+_AFT.testVerbStatusSuccess('testControlsCrossfadeDisableSuccess','mediaplayer','controls', {value="crossfade", duration=0})
+_AFT.testVerbStatusError('testControlsCrossfadeError','mediaplayer','controls', {value="crossfade"})
+_AFT.testVerbStatusSuccess('testControlsOrderTitleSuccess','mediaplayer','controls', {value="order", sort="title"})
+_AFT.testVerbStatusSuccess('testControlsOrderNextSuccess','mediaplayer','controls', {value="next"})
+_AFT.testVerbStatusSuccess('testControlsOrderIndexSuccess','mediaplayer','controls', {value="order", sort="index"})
+_AFT.testVerbStatusError('testControlsOrderError','mediaplayer','controls', {value="order", sort="invalid"})
+_AFT.testVerbStatusSuccess('testControlsProfileLowLatencySuccess','mediaplayer','controls', {value="profile", profile="low-latency"})
+_AFT.testVerbStatusSuccess('testControlsProfileDefaultSuccess','mediaplayer','controls', {value="profile", profile="default"})
+_AFT.testVerbStatusError('testControlsProfileError','mediaplayer','controls', {value="profile", profile="invalid"})
+_AFT.testVerbStatusSuccess('testControlsBatchSuccess','mediaplayer','controls', {batch={{value="pick-track", index=1}, {value="seek", position=10000}, {value="volume", volume=40}, {value="play"}}})
+_AFT.testVerbStatusSuccess('testControlsBatchPickPauseSuccess','mediaplayer','controls', {batch={{value="pick-track", index=1}, {value="pause"}}})
+_AFT.testVerbStatusSuccess('testControlsBatchPickPausePlaySuccess','mediaplayer','controls', {value="play"})
+_AFT.testVerbStatusSuccess('testControlsBatchPauseSuccess','mediaplayer','controls', {batch={{value="volume", volume=50}, {value="pause"}}})
+_AFT.testVerbStatusSuccess('testControlsBatchStopSuccess','mediaplayer','controls', {batch={{value="pick-track", index=1}, {value="stop"}}})
+_AFT.testVerbStatusError('testControlsBatchCommandError','mediaplayer','controls', {batch={{value="volume", volume=40}, {value="invalid"}}})
+_AFT.testVerbStatusError('testControlsBatchError','mediaplayer','controls', {batch="play"})
+
+_AFT.testVerbStatusSuccess('testSearchSuccess','mediaplayer','search', {text="a"})
+_AFT.testVerbStatusSuccess('testSearchPrefixSuccess','mediaplayer','search', {text="the", match="prefix", fields={"artist", "album"}, offset=0, limit=10})
+_AFT.testVerbStatusSuccess('testSearchGenreSuccess','mediaplayer','search', {genre="rock"})
+_AFT.testVerbStatusError('testSearchMatchError','mediaplayer','search', {text="a", match="invalid"})
+_AFT.testVerbStatusError('testSearchFieldsError','mediaplayer','search', {text="a", fields={"genre"}})
+
+_AFT.testVerbStatusSuccess('testBrowseArtistsSuccess','mediaplayer','browse', {})
+_AFT.testVerbStatusSuccess('testBrowseAlbumsSuccess','mediaplayer','browse', {artist="", offset=0, limit=10})
+_AFT.testVerbStatusSuccess('testBrowseTracksSuccess','mediaplayer','browse', {artist="", album=""})
+_AFT.testVerbStatusError('testBrowseAlbumError','mediaplayer','browse', {album=""})
+
+_AFT.testVerbStatusSuccess('testHistoryRecentSuccess','mediaplayer','history', {})
+_AFT.testVerbStatusSuccess('testHistoryMostPlayedSuccess','mediaplayer','history', {view="most-played", offset=0, limit=10})
+_AFT.testVerbStatusError('testHistoryViewError','mediaplayer','history', {view="invalid"})
+
+_AFT.testVerbStatusSuccess('testStateSuccess','mediaplayer','state', {})
+_AFT.testVerbStatusError('testStateZoneError','mediaplayer','state', {zone="invalid"})
+
+_AFT.testVerbStatusSuccess('testMetricsSuccess','mediaplayer','metrics', {})
 
 
 _AFT.testVerbStatusSuccess('testSubscribePlaylistSuccess','mediaplayer','subscribe', {value="playlist"})
+_AFT.testVerbStatusSuccess('testSubscribePlaylistCompactSuccess','mediaplayer','subscribe', {value="playlist", format="compact"})
 _AFT.testVerbStatusSuccess('testSubscribeMetadataSuccess','mediaplayer','subscribe', {value="metadata"})
+_AFT.testVerbStatusSuccess('testSubscribeMetadataFilteredSuccess','mediaplayer','subscribe', {value="metadata", fields={"position", "title"}, interval=5000, art=false, bluetooth=false})
+_AFT.testVerbStatusError('testSubscribeMetadataFilteredError','mediaplayer','subscribe', {value="metadata", fields={"invalid"}})
+
+_AFT.testVerbStatusError('testSubscribeNoValueError','mediaplayer','subscribe', {})
+
+_AFT.testVerbStatusSuccess('testSubscribePlaylistRepeatSuccess','mediaplayer','subscribe', {value="playlist"})
+_AFT.testVerbStatusSuccess('testSubscribeMetadataRepeatSuccess','mediaplayer','subscribe', {value="metadata"})
 
 _AFT.testVerbStatusSuccess('testUnsubscribePlaylistSuccess','mediaplayer','unsubscribe', {value="playlist"})
+_AFT.testVerbStatusSuccess('testUnsubscribePlaylistCompactSuccess','mediaplayer','unsubscribe', {value="playlist", format="compact"})
 _AFT.testVerbStatusSuccess('testUnsubscribeMetadataSuccess','mediaplayer','unsubscribe', {value="metadata"})
+_AFT.testVerbStatusSuccess('testUnsubscribeMetadataFilteredSuccess','mediaplayer','unsubscribe', {value="metadata", fields={"position", "title"}, interval=5000, art=false, bluetooth=false})
@@ -0,0 +1,179 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2017 Konsulko Group
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""
+Measure what subscribing to a mediaplayer event costs as subscribers grow.
+
+Clients are started one after the other, each in its own afb-client
+websocket session, and subscribe once connected. For every new subscriber
+it reports the time until its reply, the bytes the new subscriber received
+and the bytes pushed to the subscribers already there. Joining must cost
+the same whatever the number of subscribers, so that N subscribers cost
+O(N) overall: it fails if the existing subscribers receive more than
+--tolerance bytes when another one joins.
+
+Run it against a binder serving the mediaplayer API, with playback stopped
+so that no position event is pushed meanwhile, e.g.:
+
+    afb-daemon --port=1234 --token=HELLO --binding=mediaplayer.so &
+    test/subscribe-bench.py --clients 48 'ws://localhost:1234/api?token=HELLO'
+"""
+
+import argparse
+import json
+import os
+import selectors
+import shutil
+import statistics
+import subprocess
+import sys
+import time
+
+CLIENTS = ("afb-client", "afb-client-demo")
+
+
+class Client:
+    def __init__(self, command):
+        self.proc = subprocess.Popen(command, stdin=subprocess.PIPE,
+                                     stdout=subprocess.PIPE,
+                                     stderr=subprocess.DEVNULL, bufsize=0)
+        os.set_blocking(self.proc.stdout.fileno(), False)
+        self.received = bytearray()
+
+    def send(self, line):
+        self.proc.stdin.write(line.encode() + b"\n")
+
+    def read(self):
+        try:
+            data = os.read(self.proc.stdout.fileno(), 65536)
+        except BlockingIOError:
+            return
+        if not data:
+            raise RuntimeError("afb-client exited, is the binder running?")
+        self.received += data
+
+    def close(self):
+        self.proc.stdin.close()
+        self.proc.terminate()
+        self.proc.wait()
+
+
+def pump(selector, until):
+    """read the output of every client until the @until monotonic time"""
+    while True:
+        timeout = until() if callable(until) else until - time.monotonic()
+        if timeout is None or timeout <= 0:
+            return
+        for key, _ in selector.select(timeout):
+            key.data.read()
+
+
+def subscribe(selector, client, request, timeout):
+    """subscribe @client, returns the seconds until its reply"""
+    start = time.monotonic()
+    offset = len(client.received)
+    deadline = start + timeout
+
+    client.send(request)
+
+    def replied():
+        if b"ON-REPLY" in client.received[offset:]:
+            return None
+        if time.monotonic() >= deadline:
+            raise RuntimeError("no reply to subscribe within %g s" % timeout)
+        return deadline - time.monotonic()
+
+    pump(selector, replied)
+
+    return time.monotonic() - start
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("uri", help="websocket URI of the binder API")
+    parser.add_argument("--clients", type=int, default=32,
+                        help="number of subscribers (default: %(default)s)")
+    parser.add_argument("--api", default="mediaplayer")
+    parser.add_argument("--value", default="playlist",
+                        help="event to subscribe to (default: %(default)s)")
+    parser.add_argument("--zone", help="zone to subscribe to")
+    parser.add_argument("--settle", type=float, default=0.2,
+                        help="seconds to wait for pushes after each reply")
+    parser.add_argument("--timeout", type=float, default=5.0,
+                        help="seconds to wait for each reply")
+    parser.add_argument("--tolerance", type=int, default=0,
+                        help="bytes existing subscribers may receive per join")
+    parser.add_argument("--client", help="afb-client binary to use")
+    args = parser.parse_args()
+
+    binary = args.client or next(filter(shutil.which, CLIENTS), None)
+    if not binary:
+        sys.exit("no afb-client found, use --client")
+
+    params = {"value": args.value}
+    if args.zone:
+        params["zone"] = args.zone
+    request = "%s subscribe %s" % (args.api, json.dumps(params))
+
+    selector = selectors.DefaultSelector()
+    clients = []
+    rows = []
+
+    print("%11s %10s %12s %14s" % ("subscribers", "reply ms", "reply bytes",
+                                   "pushed bytes"))
+
+    try:
+        for n in range(1, args.clients + 1):
+            client = Client([binary, args.uri])
+            selector.register(client.proc.stdout, selectors.EVENT_READ, client)
+
+            offsets = [len(c.received) for c in clients]
+            offset = len(client.received)
+
+            elapsed = subscribe(selector, client, request, args.timeout)
+            pump(selector, time.monotonic() + args.settle)
+
+            reply = len(client.received) - offset
+            pushed = sum(len(c.received) - o for c, o in zip(clients, offsets))
+            clients.append(client)
+            rows.append((elapsed, reply, pushed))
+
+            print("%11d %10.2f %12d %14d" % (n, elapsed * 1000, reply, pushed))
+    finally:
+        for client in clients:
+            client.close()
+
+    times = [row[0] * 1000 for row in rows]
+    half = len(times) // 2
+    pushed = max(row[2] for row in rows)
+
+    print()
+    print("reply ms: median %.2f, first half %.2f, second half %.2f" %
+          (statistics.median(times), statistics.mean(times[:half] or times),
+           statistics.mean(times[half:])))
+    print("bytes pushed to existing subscribers per join: max %d" % pushed)
+
+    if pushed > args.tolerance:
+        print("FAIL: joining pushes to the existing subscribers, the cost "
+              "grows with their number")
+        return 1
+
+    print("PASS: joining costs the same whatever the number of subscribers")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())